@@ -0,0 +1,252 @@
+/*
+ * This file is part of libsidplayfp, a SID player engine.
+ *
+ * Copyright 2023 Leandro Nini <drfiemost@users.sourceforge.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <cstdlib>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+/*
+ * Batch fitting: a list of datasets is fitted by a pool of threads,
+ * each fit running single threaded.
+ */
+
+struct job_t
+{
+    std::string file;
+    // selects the starting point
+    int chip;
+    uintmax_t size;
+};
+
+/**
+ * Datasets to fit, either all the .csv and .bin files of a directory
+ * or the entries of a list file, one per line as "<file> [chip]".
+ * Relative paths in a list are taken from the list's directory.
+ *
+ * @return false on error, with a description in error
+ */
+inline bool ListJobs(const std::string &path, int chip, std::vector<job_t> &jobs, std::string &error)
+{
+    namespace fs = std::filesystem;
+    std::error_code ec;
+
+    if (fs::is_directory(path, ec))
+    {
+        for (const fs::directory_entry &entry: fs::directory_iterator(path, ec))
+        {
+            const std::string ext = entry.path().extension().string();
+            if (entry.is_regular_file() && (ext == ".csv" || ext == ".bin"))
+                jobs.push_back({ entry.path().string(), chip, 0 });
+        }
+        std::sort(jobs.begin(), jobs.end(), [](const job_t &a, const job_t &b) { return a.file < b.file; });
+    }
+    else
+    {
+        std::ifstream is(path);
+        if (!is)
+        {
+            error = "cannot read " + path;
+            return false;
+        }
+        const fs::path dir = fs::path(path).parent_path();
+        std::string line;
+        while (std::getline(is, line))
+        {
+            std::istringstream ss(line);
+            std::string file;
+            if (!(ss >> file) || file[0] == '#')
+                continue;
+            int c = chip;
+            ss >> c;
+            fs::path p(file);
+            if (p.is_relative())
+                p = dir / p;
+            jobs.push_back({ p.string(), c, 0 });
+        }
+    }
+
+    if (ec)
+    {
+        error = path + ": " + ec.message();
+        return false;
+    }
+    if (jobs.empty())
+    {
+        error = "no datasets in " + path;
+        return false;
+    }
+
+    for (job_t &job: jobs)
+    {
+        job.size = fs::file_size(job.file, ec);
+        if (ec)
+            job.size = 0;
+    }
+    return true;
+}
+
+/**
+ * Names of the result files of the jobs, "<file name>.txt" or, when
+ * another job in the list already has that name, as the same dataset
+ * listed twice or files with the same name in different directories do,
+ * "<file name>.<n>.txt" with the first free n from 2 on.
+ */
+inline std::vector<std::string> ResultNames(const std::vector<job_t> &jobs)
+{
+    std::set<std::string> used;
+    std::vector<std::string> names;
+    for (const job_t &job: jobs)
+    {
+        const std::string base = std::filesystem::path(job.file).filename().string();
+        std::string name = base + ".txt";
+        for (unsigned int n = 2; !used.insert(name).second; n++)
+            name = base + "." + std::to_string(n) + ".txt";
+        names.push_back(name);
+    }
+    return names;
+}
+
+/**
+ * Work stealing queue of job indices.
+ *
+ * Each worker owns a deque and takes jobs from its back, when it runs
+ * dry it steals from the front of the others. Jobs are dealt round robin
+ * largest first, so the long fits start early and the short ones
+ * fill the gaps at the end.
+ */
+class WorkQueue
+{
+private:
+    struct alignas(64) queue_t
+    {
+        std::mutex mutex;
+        std::deque<size_t> jobs;
+    };
+
+    std::vector<queue_t> queues;
+
+public:
+    WorkQueue(unsigned int workers, const std::vector<job_t> &jobs) :
+        queues(workers)
+    {
+        std::vector<size_t> order(jobs.size());
+        for (size_t i = 0; i < order.size(); i++)
+            order[i] = i;
+        std::stable_sort(order.begin(), order.end(), [&jobs](size_t a, size_t b) { return jobs[a].size > jobs[b].size; });
+
+        // the owner pops from the back, so deal in reverse
+        for (size_t i = 0; i < order.size(); i++)
+            queues[i % workers].jobs.push_front(order[i]);
+    }
+
+    bool pop(unsigned int worker, size_t &job)
+    {
+        {
+            queue_t &q = queues[worker];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (!q.jobs.empty())
+            {
+                job = q.jobs.back();
+                q.jobs.pop_back();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < queues.size(); i++)
+        {
+            queue_t &q = queues[(worker + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (!q.jobs.empty())
+            {
+                job = q.jobs.front();
+                q.jobs.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// workers RunParallel() will use
+inline unsigned int ParallelWorkers(unsigned int workers, size_t count)
+{
+    return std::max(1u, std::min<unsigned int>(workers, count));
+}
+
+/**
+ * Run f(worker, i) for i in [0, count) on a pool of worker threads,
+ * for tasks of about the same size, taken in order.
+ */
+template<typename F>
+inline void RunParallel(unsigned int workers, size_t count, F f)
+{
+    workers = ParallelWorkers(workers, count);
+    std::atomic<size_t> next(0);
+
+    auto work = [&next, count, &f](unsigned int worker) {
+        for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < count;)
+            f(worker, i);
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned int w = 1; w < workers; w++)
+        threads.emplace_back(work, w);
+    work(0);
+    for (std::thread &t: threads)
+        t.join();
+}
+
+/**
+ * Run f(job index) for all the jobs on a pool of worker threads.
+ */
+template<typename F>
+inline void RunPool(unsigned int workers, const std::vector<job_t> &jobs, F f)
+{
+    workers = std::max(1u, std::min<unsigned int>(workers, jobs.size()));
+    WorkQueue queue(workers, jobs);
+
+    auto work = [&queue, &f](unsigned int worker) {
+        size_t job;
+        while (queue.pop(worker, job))
+            f(job);
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned int w = 1; w < workers; w++)
+        threads.emplace_back(work, w);
+    work(0);
+    for (std::thread &t: threads)
+        t.join();
+}
+
+#endif
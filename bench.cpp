@@ -0,0 +1,455 @@
+/*
+ * This file is part of libsidplayfp, a SID player engine.
+ *
+ * Copyright 2023 Leandro Nini <drfiemost@users.sourceforge.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Microbenchmarks for the scoring kernels and the optimizer loop.
+ *
+ * All inputs are derived from the compiled-in tables and a fixed
+ * seed so that runs are comparable, results are printed as JSON.
+ */
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <limits>
+#include <chrono>
+#include <random>
+#include <algorithm>
+
+#include "parameters.h"
+#include "reference.h"
+#include "chips.h"
+#include "model.h"
+#include "optimizer.h"
+#include "device.h"
+#include "sweep.h"
+#include "export.h"
+#include "spline.h"
+
+// minimum run time of each benchmark
+static const double MIN_TIME = 0.2;
+
+static std::vector<std::string> results;
+
+static void Report(const std::string &name, uint64_t ops, double seconds, const std::string &extra = "")
+{
+    std::ostringstream ss;
+    ss.precision(6);
+    ss << "    {\"name\": \"" << name << "\", \"ops\": " << ops
+       << ", \"seconds\": " << seconds
+       << ", \"ns_per_op\": " << seconds * 1e9 / ops
+       << ", \"ops_per_second\": " << ops / seconds;
+    if (!extra.empty())
+        ss << ", " << extra;
+    ss << "}";
+    results.push_back(ss.str());
+}
+
+/**
+ * Run f() repeatedly, doubling the iteration count
+ * until it takes at least MIN_TIME.
+ * f takes the iteration count and returns the number of operations.
+ */
+template<typename F>
+static void Measure(const std::string &name, F f, const std::string &extra = "")
+{
+    for (uint64_t n = 1;; n *= 2)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        const uint64_t ops = f(n);
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (seconds >= MIN_TIME)
+        {
+            Report(name, ops, seconds, extra);
+            return;
+        }
+    }
+}
+
+// candidates scattered around the starting point
+static std::vector<Parameters> Candidates(int chip, size_t n)
+{
+    uint64_t state = chip;
+    std::vector<Parameters> candidates(n, InitialParameters(chip));
+    for (Parameters &p: candidates)
+    {
+        for (int i = 0; i < p.size(); i++)
+        {
+            const double u = (SplitMix64(state) >> 11) * 0x1.0p-53;
+            p.Scale(i, 1. + 1e-3 * (u - 0.5));
+        }
+    }
+    return candidates;
+}
+
+// grid sweep on the device, or on the host without one, ops are candidates
+static void BenchSweep(const Reference &reference, const Parameters &params, const std::string &prefix)
+{
+    volatile double sink = 0.;
+    const grid_t grid = GridAround(params, 1., 1 << 18);
+    Measure(prefix + "device_sweep", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; i++)
+            sink = DeviceSweep(reference, grid, 8)[0].score.error;
+        return n * grid.size();
+    });
+    // same grid on the batched scorer, one thread
+    Measure(prefix + "batch_sweep", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; i++)
+            sink = BatchSweep(reference, grid.size(), 8, 1, executor_t(), [&grid](uint64_t i) { return grid.at(i); })[0].score.error;
+        return n * grid.size();
+    });
+}
+
+template<typename Chip>
+static void BenchChip()
+{
+    const int chip = Chip::id;
+    // the generic loops, the specialized ones are measured separately
+    const Reference reference(ref_vector_t(std::begin(Chip::table), std::end(Chip::table)));
+    const std::string prefix = std::to_string(chip) + "/";
+
+    const Parameters params = InitialParameters(chip);
+    const double error = params.Score(reference, nullptr, std::numeric_limits<double>::infinity()).error;
+
+    volatile double sink = 0.;
+
+    // full evaluation of a single candidate
+    Measure(prefix + "score", [&](uint64_t n) {
+        double sum = 0.;
+        for (uint64_t i = 0; i < n; i++)
+            sum += params.Score(reference, nullptr, std::numeric_limits<double>::infinity()).error;
+        sink = sum;
+        return n;
+    });
+
+    // same with the loop specialized for the chip table
+    Measure(prefix + "score_model", [&](uint64_t n) {
+        double sum = 0.;
+        for (uint64_t i = 0; i < n; i++)
+            sum += Model<Chip>::Score(params, std::numeric_limits<double>::infinity()).error;
+        sink = sum;
+        return n;
+    });
+
+    // the other transfer functions, starting from the same curve
+    for (Transfer_t t: { Transfer_t::RICHARDS, Transfer_t::DOUBLE_LOGISTIC })
+    {
+        const Parameters p = Parameters::FromLogistic(params, t);
+        Measure(prefix + "score_model/" + toString(t), [&](uint64_t n) {
+            double sum = 0.;
+            for (uint64_t i = 0; i < n; i++)
+                sum += Model<Chip>::Score(p, std::numeric_limits<double>::infinity()).error;
+            sink = sum;
+            return n;
+        });
+    }
+
+    // the other error metrics, on the generic loops
+    for (Metric_t m: { Metric_t::HUBER, Metric_t::MAX_ABS })
+    {
+        Reference r = reference;
+        r.setMetric(m, 0.05);
+        Measure(prefix + "score/" + toString(m), [&](uint64_t n) {
+            double sum = 0.;
+            for (uint64_t i = 0; i < n; i++)
+                sum += params.Score(r, nullptr, std::numeric_limits<double>::infinity()).error;
+            sink = sum;
+            return n;
+        });
+    }
+
+    // single precision screen
+    Measure(prefix + "score_float", [&](uint64_t n) {
+        double sum = 0.;
+        for (uint64_t i = 0; i < n; i++)
+            sum += params.ScoreFloat(reference, std::numeric_limits<double>::infinity()).error;
+        sink = sum;
+        return n;
+    });
+
+    // candidate which only changes v, from the cached softplus of the base
+    aligned_vector_t softplus(reference.paddedSize());
+    params.GetSoftplus(reference, softplus.data());
+    Measure(prefix + "score_softplus", [&](uint64_t n) {
+        double sum = 0.;
+        for (uint64_t i = 0; i < n; i++)
+            sum += params.ScoreSoftplus(reference, softplus.data(), std::numeric_limits<double>::infinity()).error;
+        sink = sum;
+        return n;
+    });
+
+    // rejected candidate, the bound stops the evaluation early
+    Measure(prefix + "score_rejected", [&](uint64_t n) {
+        double sum = 0.;
+        for (uint64_t i = 0; i < n; i++)
+            sum += params.Score(reference, nullptr, error * 0.5).error;
+        sink = sum;
+        return n;
+    });
+
+    // transfer function over a dense sweep of the input range
+    const size_t points = 4096;
+    std::vector<double> x(points), y(points);
+    for (size_t i = 0; i < points; i++)
+        x[i] = (reference.getVmax() - reference.getVmin()) * i / (points - 1);
+    Measure(prefix + "eval_sweep", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; i++)
+            params.GetValues(x.data(), y.data(), points);
+        sink = y[points / 2];
+        return n * points;
+    });
+
+    // population scoring, ops are candidates
+    for (size_t K: { 8, 64, 512 })
+    {
+        const std::vector<Parameters> candidates = Candidates(chip, K);
+        std::vector<score_t> scores(K);
+        Measure(prefix + "score_batch/" + std::to_string(K), [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; i++)
+                ScoreBatch(reference, candidates.data(), scores.data(), K, std::numeric_limits<double>::infinity());
+            sink = scores[0].error;
+            return n * K;
+        });
+        Measure(prefix + "score_batch_model/" + std::to_string(K), [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; i++)
+                Model<Chip>::ScoreBatch(candidates.data(), scores.data(), K, std::numeric_limits<double>::infinity());
+            sink = scores[0].error;
+            return n * K;
+        });
+        Measure(prefix + "score_batch_float/" + std::to_string(K), [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; i++)
+                ScoreBatchFloat(reference, candidates.data(), scores.data(), K, std::numeric_limits<double>::infinity());
+            sink = scores[0].error;
+            return n * K;
+        });
+    }
+
+    BenchSweep(reference, params, prefix);
+
+    // end to end optimizer throughput, ops are trials,
+    // on the specialized reference as used by the command line tool
+    const Reference model = Model<Chip>::reference();
+    const unsigned int maxThreads = SearchThreads(config_t());
+    for (unsigned int threads = 1; threads <= maxThreads; threads++)
+    {
+        config_t config;
+        config.threads = threads;
+        config.seed = 1;
+        config.quiet = true;
+        config.maxTrials = 2000000ULL * threads;
+
+        islands_t islands;
+        islands.emplace_back(new SharedBest(params, params.Score(model, nullptr, std::numeric_limits<double>::infinity())));
+        run_t run(threads);
+        Search(model, config, islands, run);
+        const double seconds = run.elapsed();
+
+        Parameters best;
+        score_t score;
+        islands[0]->read(best, score);
+        std::ostringstream extra;
+        extra.precision(std::numeric_limits<double>::max_digits10);
+        extra << "\"threads\": " << threads << ", \"score\": " << score.error;
+        Report(prefix + "optimizer/" + std::to_string(threads), run.total().trials, seconds, extra.str());
+    }
+}
+
+/**
+ * Monotone cubic interpolation of the measured points, with the
+ * Fritsch-Carlson tangents, as libsidplayfp builds its opamp tables.
+ */
+static spline_t MonotoneSpline(const std::vector<data_t> &points)
+{
+    const size_t n = points.size();
+    std::vector<double> d(n - 1), m(n);
+    for (size_t i = 0; i + 1 < n; i++)
+        d[i] = (points[i + 1].Vout - points[i].Vout) / (points[i + 1].Vin - points[i].Vin);
+    m[0] = d[0];
+    m[n - 1] = d[n - 2];
+    for (size_t i = 1; i + 1 < n; i++)
+    {
+        const double h0 = points[i].Vin - points[i - 1].Vin;
+        const double h1 = points[i + 1].Vin - points[i].Vin;
+        m[i] = d[i - 1] * d[i] <= 0. ? 0. : 3. * (h0 + h1) / ((2. * h1 + h0) / d[i - 1] + (h1 + 2. * h0) / d[i]);
+    }
+
+    spline_t spline;
+    spline.Vmin = points.front().Vin;
+    spline.Vmax = points.back().Vin;
+    spline.maxError = 0.;
+    for (size_t i = 0; i + 1 < n; i++)
+    {
+        const double h = points[i + 1].Vin - points[i].Vin;
+        spline.x.push_back(points[i].Vin);
+        spline.c.push_back({ points[i].Vout, m[i], (3. * d[i] - 2. * m[i] - m[i + 1]) / h, (m[i] + m[i + 1] - 2. * d[i]) / (h * h) });
+    }
+    spline.x.push_back(spline.Vmax);
+    return spline;
+}
+
+// linear interpolation of the measured points
+static double InterpolatePoints(const std::vector<data_t> &points, double Vin)
+{
+    const auto it = std::upper_bound(points.begin() + 1, points.end() - 1, Vin, [](double v, const data_t &p) { return v < p.Vin; });
+    const data_t &a = it[-1];
+    const data_t &b = it[0];
+    const double t = std::min(std::max((Vin - a.Vin) / (b.Vin - a.Vin), 0.), 1.);
+    return a.Vout + t * (b.Vout - a.Vout);
+}
+
+/**
+ * Per sample cost of the fitted curve in the forms it can be exported in,
+ * and of the measured points interpolated at run time, ops are samples.
+ * The inputs are either scattered over the range or a slow ramp,
+ * closer to what the filter sees. Each entry also gives the size of
+ * its tables in bytes and its largest distance from the formula in volts.
+ */
+template<typename Chip>
+static void BenchEval(const std::vector<data_t> &points)
+{
+    const int chip = Chip::id;
+    const Reference reference = Model<Chip>::reference();
+    const Parameters params = InitialParameters(chip);
+    const std::string prefix = std::to_string(chip) + "/eval/";
+    const double Vmin = reference.getVmin();
+    const double range = reference.getVmax() - Vmin;
+
+    const size_t n = 1 << 16;
+    std::vector<double> scattered(n), ramp(n);
+    uint64_t state = chip;
+    for (size_t i = 0; i < n; i++)
+    {
+        scattered[i] = Vmin + range * ((SplitMix64(state) >> 11) * 0x1.0p-53);
+        ramp[i] = Vmin + range * i / (n - 1);
+    }
+
+    volatile double sink = 0.;
+    auto bench = [&](const std::string &name, size_t bytes, auto f) {
+        double maxError = 0.;
+        for (size_t i = 0; i <= 4 * n; i++)
+        {
+            const double Vin = Vmin + range * i / (4 * n);
+            maxError = std::max(maxError, std::abs(f(Vin) - CurveValue(params, reference, Vin)));
+        }
+        std::ostringstream extra;
+        extra << "\"bytes\": " << bytes << ", \"max_error\": " << maxError;
+
+        for (const std::vector<double>* inputs: { &scattered, &ramp })
+        {
+            Measure(prefix + name + (inputs == &ramp ? "/ramp" : "/scattered"), [&](uint64_t k) {
+                double sum = 0.;
+                for (uint64_t j = 0; j < k; j++)
+                    for (double Vin: *inputs)
+                        sum += f(Vin);
+                sink = sum;
+                return k * n;
+            }, extra.str());
+        }
+    };
+
+    bench("formula", params.size() * sizeof(double), [&](double Vin) { return CurveValue(params, reference, Vin); });
+
+    for (unsigned int bits: { 8, 10, 12, 16 })
+    {
+        const lut_t lut = BuildLut(params, reference, bits);
+        const size_t bytes = lut.forward.size() * sizeof(uint16_t);
+        bench("lut/" + std::to_string(bits), bytes, [&lut](double Vin) { return EvaluateLut(lut, Vin); });
+        bench("lut_linear/" + std::to_string(bits), bytes, [&lut](double Vin) { return InterpolateLut(lut, Vin); });
+    }
+
+    for (double target: { 1e-3, 1e-4, 1e-5 })
+    {
+        std::ostringstream name;
+        name << "spline/" << target;
+        spline_t spline;
+        std::string error;
+        if (!BuildSpline(params, reference, target, spline, error))
+        {
+            // the output stays valid json
+            std::cerr << prefix << name.str() << ": " << error << std::endl;
+            continue;
+        }
+        bench(name.str(), (spline.x.size() + 4 * spline.c.size()) * sizeof(double), [&spline](double Vin) { return EvaluateSpline(spline, Vin); });
+    }
+
+    // the measured points, the error is how far they are from the fit
+    bench("points/linear", points.size() * sizeof(data_t), [&points](double Vin) { return InterpolatePoints(points, Vin); });
+    const spline_t monotone = MonotoneSpline(points);
+    bench("points/monotone", (monotone.x.size() + 4 * monotone.c.size()) * sizeof(double), [&monotone](double Vin) { return EvaluateSpline(monotone, Vin); });
+}
+
+// generator throughput, ops are draws
+static void BenchRandom()
+{
+    volatile double sink = 0.;
+    Rng rng(1);
+
+    Measure("rng/bits", [&](uint64_t n) {
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < n; i++)
+            sum += GetRandomBits(rng);
+        sink = static_cast<double>(sum);
+        return n;
+    });
+
+    Measure("rng/gaussian", [&](uint64_t n) {
+        double sum = 0.;
+        for (uint64_t i = 0; i < n; i++)
+            sum += GetGaussian(rng);
+        sink = sum;
+        return n;
+    });
+
+    std::default_random_engine engine(1);
+    std::normal_distribution<> normal(0., 1.);
+    Measure("rng/std_normal_distribution", [&](uint64_t n) {
+        double sum = 0.;
+        for (uint64_t i = 0; i < n; i++)
+            sum += normal(engine);
+        sink = sum;
+        return n;
+    });
+}
+
+int main()
+{
+    BenchRandom();
+    BenchChip<Chip6581>();
+    BenchChip<Chip8580>();
+    BenchEval<Chip6581>(opamp_voltage6581);
+    BenchEval<Chip8580>(opamp_voltage8580);
+
+    std::cout << "{" << std::endl
+        << "  \"isa\": \"" << simd::isa << "\"," << std::endl
+        << "  \"lanes\": " << simd::vdouble::width << "," << std::endl
+        << "  \"rng\": \"" << Rng::name << "\"," << std::endl
+        << "  \"benchmarks\": [" << std::endl;
+    for (size_t i = 0; i < results.size(); i++)
+        std::cout << results[i] << (i + 1 < results.size() ? "," : "") << std::endl;
+    std::cout << "  ]" << std::endl
+        << "}" << std::endl;
+
+    return EXIT_SUCCESS;
+}
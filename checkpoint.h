@@ -0,0 +1,264 @@
+/*
+ * This file is part of libsidplayfp, a SID player engine.
+ *
+ * Copyright 2023 Leandro Nini <drfiemost@users.sourceforge.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <cstdint>
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <system_error>
+
+#include "parameters.h"
+#include "reference.h"
+#include "sharedbest.h"
+#include "optimizer.h"
+
+/*
+ * Checkpoints of the search state, a small text file:
+ *
+ *   opamp-checkpoint 5
+ *   reference <hash of the dataset>
+ *   objective <metric> [<huber delta>] [region <lo> <hi> <weight>]...
+ *   options <model> <islands> <lanes> <proposals> <screen> <strategy> <deterministic> <logq> <logb> <migrate>
+ *   trials <trials> <last improvement> <next migration>
+ *   elapsed <seconds>
+ *   stats <trials> <improvements> <entropy> <sampled scores> <sampled ns>
+ *   island <parameters> <score>                      one per island
+ *   lanes <count>
+ *   lane <generator state> <strategy state>          one per lane
+ *   workers <count>
+ *   worker [<generator state> <strategy state>]      one per thread of the free running search
+ *   end
+ *
+ * Doubles are written with max_digits10 digits so they read back exactly.
+ * The deterministic search is checkpointed between epochs with the
+ * state of all its lanes, so a resumed run is identical to one that
+ * was never stopped. The free running threads publish their states
+ * every checkpoint interval, so apart from the last checkpoint they
+ * may be behind the island bests; a worker line is empty for a thread
+ * which never published. On resume each thread carries on with its
+ * state, the threads without one start on new streams.
+ */
+
+static const unsigned int CHECKPOINT_VERSION = 5;
+
+/**
+ * Write the checkpoint to a temporary file and rename it over
+ * the old one, so that an interrupted write never leaves
+ * a truncated checkpoint behind.
+ */
+inline bool WriteCheckpoint(const std::string &file, const config_t &config, const Reference &reference, const islands_t &islands, const run_t &run)
+{
+    const std::string tmp = file + ".tmp";
+    {
+        std::ofstream os(tmp);
+        os.precision(std::numeric_limits<double>::max_digits10);
+
+        os << "opamp-checkpoint " << CHECKPOINT_VERSION << std::endl;
+        os << "reference " << reference.hash() << std::endl;
+        os << "objective " << reference.objective() << std::endl;
+        os << "options " << toString(config.transfer) << " " << islands.size() << " " << config.lanes << " " << config.proposals << " " << config.screen << " "
+           << static_cast<int>(config.strategy) << " " << config.deterministic << " "
+           << config.logq << " " << config.logb << " " << config.migrate << std::endl;
+        os << "trials " << run.trials.load() << " " << run.lastImprovement.load() << " " << run.nextMigration.load() << std::endl;
+        os << "elapsed " << run.elapsed() << std::endl;
+
+        const stats_t stats = run.total();
+        os << "stats " << stats.trials << " " << stats.improvements << " " << stats.entropy << " "
+           << stats.sampledScores << " " << stats.sampledNs << std::endl;
+
+        for (const std::unique_ptr<SharedBest> &island: islands)
+        {
+            Parameters p;
+            score_t score;
+            island->read(p, score);
+            os << "island ";
+            for (int i = 0; i < p.size(); i++)
+                os << p.theta[i] << " ";
+            os << score.error << std::endl;
+        }
+
+        os << "lanes " << run.lanes.size() << std::endl;
+        for (const lane_t &lane: run.lanes)
+        {
+            os << "lane ";
+            lane.save(os);
+            os << std::endl;
+        }
+        // the free running workers, the states of the others
+        // may be up to a checkpoint interval old
+        os << "workers " << run.workers.size() << std::endl;
+        for (const worker_state_t &w: run.workers)
+            os << "worker " << w.get() << std::endl;
+        os << "end" << std::endl;
+
+        if (!os)
+            return false;
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tmp, file, ec);
+    return !ec;
+}
+
+/**
+ * Restore the islands and the run state from a checkpoint.
+ * The dataset and the search options must match the ones
+ * the checkpoint was written with.
+ *
+ * @return false on error, with a description in error
+ */
+inline bool ReadCheckpoint(const std::string &file, const config_t &config, const Reference &reference, islands_t &islands, run_t &run, std::string &error)
+{
+    std::ifstream is(file);
+    if (!is)
+    {
+        error = "cannot read " + file;
+        return false;
+    }
+
+    auto expect = [&is](const char* keyword) {
+        std::string word;
+        return static_cast<bool>(is >> word) && word == keyword;
+    };
+
+    unsigned int version;
+    if (!expect("opamp-checkpoint") || !(is >> version) || version != CHECKPOINT_VERSION)
+    {
+        error = "not a checkpoint or unsupported version";
+        return false;
+    }
+
+    uint64_t hash;
+    if (!expect("reference") || !(is >> hash) || hash != reference.hash())
+    {
+        error = "the checkpoint is for a different dataset";
+        return false;
+    }
+
+    std::string objective;
+    if (!expect("objective") || !std::getline(is >> std::ws, objective) || objective != reference.objective())
+    {
+        error = "the checkpoint was written with a different objective";
+        return false;
+    }
+
+    std::string transfer;
+    size_t M, lanes, proposals;
+    int strategy;
+    bool screen, deterministic, logq, logb;
+    uint64_t migrate;
+    if (!expect("options") || !(is >> transfer >> M >> lanes >> proposals >> screen >> strategy >> deterministic >> logq >> logb >> migrate))
+    {
+        error = "corrupt options";
+        return false;
+    }
+    if (transfer != toString(config.transfer) || M != config.islands || lanes != config.lanes || proposals != config.proposals || screen != config.screen
+        || strategy != static_cast<int>(config.strategy) || deterministic != config.deterministic
+        || logq != config.logq || logb != config.logb || migrate != config.migrate)
+    {
+        error = "the checkpoint was written with different search options";
+        return false;
+    }
+
+    uint64_t trials, lastImprovement, nextMigration;
+    double elapsed;
+    stats_t stats;
+    if (!expect("trials") || !(is >> trials >> lastImprovement >> nextMigration)
+        || !expect("elapsed") || !(is >> elapsed)
+        || !expect("stats") || !(is >> stats.trials >> stats.improvements >> stats.entropy >> stats.sampledScores >> stats.sampledNs))
+    {
+        error = "corrupt counters";
+        return false;
+    }
+
+    islands.clear();
+    for (size_t i = 0; i < M; i++)
+    {
+        Parameters p(config.transfer);
+        score_t score;
+        bool ok = expect("island");
+        for (int k = 0; ok && k < p.size(); k++)
+            ok = static_cast<bool>(is >> p.theta[k]);
+        if (!ok || !(is >> score.error))
+        {
+            error = "corrupt island " + std::to_string(i);
+            return false;
+        }
+        islands.emplace_back(new SharedBest(p, score));
+    }
+
+    size_t count;
+    if (!expect("lanes") || !(is >> count))
+    {
+        error = "corrupt lanes";
+        return false;
+    }
+    run.lanes.clear();
+    run.lanes.reserve(count);
+    for (size_t k = 0; k < count; k++)
+    {
+        run.lanes.emplace_back(config.proposals, TransferSize(config.transfer));
+        if (!expect("lane") || !run.lanes.back().load(is))
+        {
+            error = "corrupt lane " + std::to_string(k);
+            return false;
+        }
+    }
+
+    if (!expect("workers") || !(is >> count))
+    {
+        error = "corrupt workers";
+        return false;
+    }
+    for (size_t t = 0; t < count; t++)
+    {
+        std::string state;
+        if (!expect("worker") || !std::getline(is, state))
+        {
+            error = "corrupt worker " + std::to_string(t);
+            return false;
+        }
+        // with fewer threads the extra states are dropped
+        state.erase(0, state.find_first_not_of(' '));
+        if (t < run.workers.size())
+            run.workers[t].set(state);
+    }
+
+    if (!expect("end"))
+    {
+        error = "truncated checkpoint";
+        return false;
+    }
+
+    run.trials = trials;
+    run.lastImprovement = lastImprovement;
+    run.nextMigration = nextMigration;
+    run.resumed = stats;
+    run.start = std::chrono::steady_clock::now() - std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(elapsed));
+    return true;
+}
+
+#endif
@@ -0,0 +1,151 @@
+/*
+ * This file is part of libsidplayfp, a SID player engine.
+ *
+ * Copyright 2023 Leandro Nini <drfiemost@users.sourceforge.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef CHIPS_H
+#define CHIPS_H
+
+#include <iterator>
+#include <vector>
+
+#include "parameters.h"
+#include "reference.h"
+
+/**
+ * This is the SID 6581 op-amp voltage transfer function, measured on
+ * CAP1B/CAP1A on a chip marked MOS 6581R4AR 0687 14.
+ * All measured chips have op-amps with output voltages (and thus input
+ * voltages) within the range of 0.81V - 10.31V.
+ */
+struct Chip6581
+{
+    static constexpr int id = 6581;
+    static constexpr data_t table[] =
+    {
+        {  0.81, 10.31 },  // Approximate start of actual range
+        {  2.40, 10.31 },
+        {  2.60, 10.30 },
+        {  2.70, 10.29 },
+        {  2.80, 10.26 },
+        {  2.90, 10.17 },
+        {  3.00, 10.04 },
+        {  3.10,  9.83 },
+        {  3.20,  9.58 },
+        {  3.30,  9.32 },
+        {  3.50,  8.69 },
+        {  3.70,  8.00 },
+        {  4.00,  6.89 },
+        {  4.40,  5.21 },
+        {  4.54,  4.54 },  // Working point (vi = vo)
+        {  4.60,  4.19 },
+        {  4.80,  3.00 },
+        {  4.90,  2.30 },  // Change of curvature
+        {  4.95,  2.03 },
+        {  5.00,  1.88 },
+        {  5.05,  1.77 },
+        {  5.10,  1.69 },
+        {  5.20,  1.58 },
+        {  5.40,  1.44 },
+        {  5.60,  1.33 },
+        {  5.80,  1.26 },
+        {  6.00,  1.21 },
+        {  6.40,  1.12 },
+        {  7.00,  1.02 },
+        {  7.50,  0.97 },
+        {  8.50,  0.89 },
+        { 10.00,  0.81 },
+        { 10.31,  0.81 },  // Approximate end of actual range
+    };
+};
+
+const std::vector<data_t> opamp_voltage6581(std::begin(Chip6581::table), std::end(Chip6581::table));
+
+/**
+ * This is the SID 8580 op-amp voltage transfer function, measured on
+ * CAP1B/CAP1A on a chip marked CSG 8580R5 1690 25.
+ */
+struct Chip8580
+{
+    static constexpr int id = 8580;
+    static constexpr data_t table[] =
+    {
+        {  1.30,  8.91 },  // Approximate start of actual range
+        {  4.76,  8.91 },
+        {  4.77,  8.90 },
+        {  4.78,  8.88 },
+        {  4.785, 8.86 },
+        {  4.79,  8.80 },
+        {  4.795, 8.60 },
+        {  4.80,  8.25 },
+        {  4.805, 7.50 },
+        {  4.81,  6.10 },
+        {  4.815, 4.05 },  // Change of curvature
+        {  4.82,  2.27 },
+        {  4.825, 1.65 },
+        {  4.83,  1.55 },
+        {  4.84,  1.47 },
+        {  4.85,  1.43 },
+        {  4.87,  1.37 },
+        {  4.90,  1.34 },
+        {  5.00,  1.30 },
+        {  5.10,  1.30 },
+        {  8.91,  1.30 },  // Approximate end of actual range
+    };
+};
+
+const std::vector<data_t> opamp_voltage8580(std::begin(Chip8580::table), std::end(Chip8580::table));
+
+/**
+ * Starting point of the search for the given chip,
+ * the best parameters found so far.
+ */
+inline Parameters InitialParameters(int chip)
+{
+    Parameters bestparams;
+
+    switch (chip)
+    {
+    case 6581:
+        // current score 1.2889417569511381
+        bestparams.SetValue(Logistic::Q, 5.5285312141864937e-05);
+        bestparams.SetValue(Logistic::B, 2.1608922897100533);
+        bestparams.SetValue(Logistic::V, 0.67181935418132133);
+        // current score 0.56449846890956767
+        bestparams.SetValue(Logistic::Q, 3.984844197538005e-05);
+        bestparams.SetValue(Logistic::B, 3.2058605554905721);
+        bestparams.SetValue(Logistic::V, 1.6858924228168377);
+        break;
+    case 8580:
+        // current score 0.47707930194395543
+        bestparams.SetValue(Logistic::Q, 2.4396355046227875e-310);
+        bestparams.SetValue(Logistic::B, 147.10522527455893);
+        bestparams.SetValue(Logistic::V, 0.01032355884323965);
+        // current score 0.1961362317665809
+        bestparams.SetValue(Logistic::Q, 1.4286997721810887e-307);
+        bestparams.SetValue(Logistic::B, 201.07159005160145);
+        bestparams.SetValue(Logistic::V, 0.76797091115300598);
+        break;
+    default:
+        break;
+    }
+
+    return bestparams;
+}
+
+#endif
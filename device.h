@@ -0,0 +1,332 @@
+/*
+ * This file is part of libsidplayfp, a SID player engine.
+ *
+ * Copyright 2023 Leandro Nini <drfiemost@users.sourceforge.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef DEVICE_H
+#define DEVICE_H
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <limits>
+#include <algorithm>
+
+#ifdef _OPENMP
+#  include <omp.h>
+#endif
+
+#include "parameters.h"
+#include "reference.h"
+#include "transfer.h"
+
+/*
+ * Bulk scoring of whole populations and dense parameter grids,
+ * offloaded to an accelerator with OpenMP target regions.
+ *
+ * Offloading needs a compiler configured for it, e.g. GCC with
+ * the nvptx or amdgcn offload compilers and FLAG_OFFLOAD in the
+ * Makefile. Without a device the target regions run on the host
+ * threads, without OpenMP they are plain loops, so the results
+ * are the same everywhere but for the last bits of the libm calls.
+ *
+ * Each device thread scores one candidate with the scalar value()
+ * of the transfer function. The samples are copied to the device
+ * once per call and the grid candidates are built on the device
+ * from their index, so only the scores come back.
+ */
+
+// grid candidates scored per target region, bounds the device memory
+static const uint64_t DEVICE_CHUNK = 1 << 22;
+
+// Candidate with its score, as returned by the sweeps
+struct candidate_t
+{
+    Parameters params;
+    score_t score;
+};
+
+#ifdef _OPENMP
+#   pragma omp declare target
+#endif
+
+// score without early exit, same formula as Parameters::Score()
+template<typename T>
+inline double DeviceError(const double* theta, const double* x, const double* vout, const double* weight, size_t n, double Vmin, double range)
+{
+    double sum = 0.;
+    for (size_t i = 0; i < n; i++)
+    {
+        const double diff = (Vmin + range*T::value(theta, x[i], nullptr, nullptr) - vout[i])*weight[i];
+        sum += diff*diff;
+    }
+    return std::sqrt(sum);
+}
+
+/**
+ * Parameters of a grid point, the first axis varies fastest.
+ * The coordinates are those of Parameters::GetLogValue(),
+ * exponential marks the axes holding a logarithm.
+ */
+inline void GridPoint(const double* center, const double* lo, const double* step, const uint64_t* points, const bool* exponential,
+    int N, uint64_t index, double* theta)
+{
+    for (int a = 0; a < N; a++)
+    {
+        theta[a] = center[a];
+        if (points[a] > 1)
+        {
+            const double coordinate = lo[a] + step[a] * static_cast<double>(index % points[a]);
+            theta[a] = exponential[a] ? std::exp(coordinate) : coordinate;
+            index /= points[a];
+        }
+    }
+}
+
+#ifdef _OPENMP
+#   pragma omp end declare target
+#endif
+
+/**
+ * Regular grid over the search coordinates of the parameters:
+ * log(q), log(b) and log(v), asymptotes and weights as they are.
+ */
+struct grid_t
+{
+    Parameters center;
+    double lo[MAX_PARAMS];
+    double hi[MAX_PARAMS];
+    // points on each axis, 1 keeps the center value
+    uint64_t points[MAX_PARAMS];
+
+    explicit grid_t(const Parameters &c) :
+        center(c)
+    {
+        for (int a = 0; a < MAX_PARAMS; a++)
+        {
+            lo[a] = hi[a] = a < c.size() ? c.GetLogValue(a) : 0.;
+            points[a] = 1;
+        }
+    }
+
+    uint64_t size() const
+    {
+        uint64_t n = 1;
+        for (int a = 0; a < center.size(); a++)
+            n *= points[a];
+        return n;
+    }
+
+    double step(int a) const
+    {
+        return points[a] > 1 ? (hi[a] - lo[a]) / static_cast<double>(points[a] - 1) : 0.;
+    }
+
+    bool exponential(int a) const
+    {
+        const Param_t role = center.role(a);
+        return role == Param_t::B || role == Param_t::V;
+    }
+
+    Parameters at(uint64_t index) const
+    {
+        double steps[MAX_PARAMS];
+        bool exp[MAX_PARAMS];
+        for (int a = 0; a < MAX_PARAMS; a++)
+        {
+            steps[a] = a < center.size() ? step(a) : 0.;
+            exp[a] = a < center.size() && exponential(a);
+        }
+        Parameters p = center;
+        GridPoint(center.theta, lo, steps, points, exp, center.size(), index, p.theta);
+        return p;
+    }
+};
+
+/**
+ * Grid of about the given number of points around the center,
+ * spanning a factor e^span either way on q, b and v
+ * with the same number of points on each of them;
+ * like IslandSeed() the asymptotes and weights are kept.
+ */
+inline grid_t GridAround(const Parameters &center, double span, uint64_t points)
+{
+    grid_t grid(center);
+
+    int axes = 0;
+    for (int a = 0; a < center.size(); a++)
+    {
+        if (center.role(a) != Param_t::A)
+            axes++;
+    }
+    const uint64_t perAxis = std::max<uint64_t>(2, static_cast<uint64_t>(std::pow(static_cast<double>(points), 1. / axes) + 1e-9));
+
+    for (int a = 0; a < center.size(); a++)
+    {
+        if (center.role(a) == Param_t::A)
+            continue;
+        grid.lo[a] -= span;
+        grid.hi[a] += span;
+        grid.points[a] = perAxis;
+    }
+    return grid;
+}
+
+// Where the target regions run
+inline std::string DeviceName()
+{
+#ifdef _OPENMP
+    const int devices = omp_get_num_devices();
+    if (devices > 0)
+        return "device " + std::to_string(omp_get_default_device()) + " of " + std::to_string(devices);
+#endif
+    return "host";
+}
+
+template<typename T>
+inline void DeviceScore(const Reference &reference, const Parameters* params, score_t* scores, size_t K)
+{
+    const size_t n = reference.size();
+    const double* x = reference.getX();
+    const double* vout = reference.getVout();
+    const double* weight = reference.getWeight();
+    const double Vmin = reference.getVmin();
+    const double range = reference.getVmax() - Vmin;
+
+    std::vector<double> theta(K * T::N);
+    for (size_t k = 0; k < K; k++)
+        std::copy(params[k].theta, params[k].theta + T::N, theta.begin() + k * T::N);
+    std::vector<double> result(K);
+
+    const double* t = theta.data();
+    double* r = result.data();
+#ifdef _OPENMP
+#   pragma omp target teams distribute parallel for map(to: x[0:n], vout[0:n], weight[0:n], t[0:K*T::N]) map(from: r[0:K])
+#endif
+    for (size_t k = 0; k < K; k++)
+        r[k] = DeviceError<T>(t + k * T::N, x, vout, weight, n, Vmin, range);
+
+    for (size_t k = 0; k < K; k++)
+        scores[k].error = result[k];
+}
+
+/**
+ * Full scores of a population of K candidates, all with
+ * the same transfer function, computed on the device.
+ * Unlike ScoreBatch() there is no bound, it only pays off
+ * for populations large enough to keep the device busy.
+ * The scores are always the squared error.
+ */
+inline void DeviceScore(const Reference &reference, const Parameters* params, score_t* scores, size_t K)
+{
+    if (K == 0)
+        return;
+    WithTransfer(params[0].transfer, [&](auto model) { DeviceScore<decltype(model)>(reference, params, scores, K); });
+}
+
+template<typename T>
+inline std::vector<candidate_t> DeviceSweep(const Reference &reference, const grid_t &grid, size_t topk)
+{
+    const size_t n = reference.size();
+    const double* x = reference.getX();
+    const double* vout = reference.getVout();
+    const double* weight = reference.getWeight();
+    const double Vmin = reference.getVmin();
+    const double range = reference.getVmax() - Vmin;
+
+    // plain arrays for the device
+    double center[MAX_PARAMS];
+    double lo[MAX_PARAMS];
+    double step[MAX_PARAMS];
+    uint64_t points[MAX_PARAMS];
+    bool exponential[MAX_PARAMS];
+    for (int a = 0; a < T::N; a++)
+    {
+        center[a] = grid.center.theta[a];
+        lo[a] = grid.lo[a];
+        step[a] = grid.step(a);
+        points[a] = grid.points[a];
+        exponential[a] = grid.exponential(a);
+    }
+
+    const uint64_t total = grid.size();
+    std::vector<double> result(std::min(total, DEVICE_CHUNK));
+    double* r = result.data();
+
+    // best scores so far with their index, a max heap of at most topk
+    std::vector<std::pair<double, uint64_t>> best;
+    best.reserve(topk + 1);
+
+#ifdef _OPENMP
+#   pragma omp target data map(to: x[0:n], vout[0:n], weight[0:n], center[0:T::N], lo[0:T::N], step[0:T::N], points[0:T::N], exponential[0:T::N])
+#endif
+    {
+        for (uint64_t first = 0; first < total; first += DEVICE_CHUNK)
+        {
+            const uint64_t count = std::min(DEVICE_CHUNK, total - first);
+#ifdef _OPENMP
+#   pragma omp target teams distribute parallel for map(from: r[0:count])
+#endif
+            for (uint64_t c = 0; c < count; c++)
+            {
+                double theta[T::N];
+                GridPoint(center, lo, step, points, exponential, T::N, first + c, theta);
+                r[c] = DeviceError<T>(theta, x, vout, weight, n, Vmin, range);
+            }
+
+            // NaNs never get in, the heap top is the worst kept
+            for (uint64_t c = 0; c < count && topk; c++)
+            {
+                const std::pair<double, uint64_t> e(r[c], first + c);
+                if (!(r[c] < std::numeric_limits<double>::infinity()) || (best.size() == topk && !(e < best.front())))
+                    continue;
+                best.push_back(e);
+                std::push_heap(best.begin(), best.end());
+                if (best.size() > topk)
+                {
+                    std::pop_heap(best.begin(), best.end());
+                    best.pop_back();
+                }
+            }
+        }
+    }
+    std::sort_heap(best.begin(), best.end());
+
+    std::vector<candidate_t> candidates(best.size());
+    for (size_t i = 0; i < best.size(); i++)
+    {
+        candidates[i].params = grid.at(best[i].second);
+        candidates[i].score.error = best[i].first;
+    }
+    return candidates;
+}
+
+/**
+ * Score every point of the grid on the device and return
+ * the topk best ones, best first.
+ */
+inline std::vector<candidate_t> DeviceSweep(const Reference &reference, const grid_t &grid, size_t topk)
+{
+    return WithTransfer(grid.center.transfer, [&](auto model) { return DeviceSweep<decltype(model)>(reference, grid, topk); });
+}
+
+#endif
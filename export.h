@@ -0,0 +1,208 @@
+/*
+ * This file is part of libsidplayfp, a SID player engine.
+ *
+ * Copyright 2023 Leandro Nini <drfiemost@users.sourceforge.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <cctype>
+
+#include <ostream>
+#include <string>
+#include <vector>
+#include <limits>
+#include <algorithm>
+
+#include "parameters.h"
+#include "reference.h"
+
+/**
+ * Fixed point lookup tables of the fitted transfer function.
+ *
+ * Both the input and output voltages are mapped linearly
+ * from [Vmin, Vmax] to [0, 65535], the forward table is indexed
+ * by the input voltage and the inverse table by the output voltage.
+ */
+struct lut_t
+{
+    double Vmin;
+    double Vmax;
+    unsigned int bits;
+    std::vector<uint16_t> forward;
+    std::vector<uint16_t> inverse;
+};
+
+inline uint16_t ToFixed(double normalized)
+{
+    return static_cast<uint16_t>(std::lround(std::min(std::max(normalized, 0.), 1.) * 65535.));
+}
+
+/**
+ * Normalized input x/(Vmax-Vmin) giving the normalized output g.
+ *
+ * The logistic e^(-log(1+e^(b*x+log(q)))/v) is inverted analytically,
+ * the other transfer functions by bisection, assuming they are
+ * monotonic over the range like the measured curves.
+ */
+inline double InverseValue(const Parameters &params, double range, double g)
+{
+    if (params.transfer == Transfer_t::LOGISTIC)
+    {
+        // s = log(1+e^t) <=> t = s + log(1-e^-s)
+        const double s = -params.theta[Logistic::V] * std::log(g);
+        const double t = s + std::log(-std::expm1(-s));
+        const double x = (t - params.theta[Logistic::Q]) / params.theta[Logistic::B];
+        return std::isnan(x) ? 0. : x / range;
+    }
+
+    double lo = 0.;
+    double hi = range;
+    const bool decreasing = params.GetNormalized(lo) > params.GetNormalized(hi);
+    for (int i = 0; i < 100 && lo < hi; i++)
+    {
+        const double mid = 0.5 * (lo + hi);
+        if ((params.GetNormalized(mid) > g) == decreasing)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return 0.5 * (lo + hi) / range;
+}
+
+inline lut_t BuildLut(const Parameters &params, const Reference &reference, unsigned int bits)
+{
+    lut_t lut;
+    lut.Vmin = reference.getVmin();
+    lut.Vmax = reference.getVmax();
+    lut.bits = bits;
+
+    const size_t n = size_t(1) << bits;
+    const double range = lut.Vmax - lut.Vmin;
+
+    std::vector<double> x(n), y(n);
+    for (size_t i = 0; i < n; i++)
+        x[i] = range * i / (n - 1);
+    params.GetValues(x.data(), y.data(), n);
+
+    lut.forward.resize(n);
+    lut.inverse.resize(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        lut.forward[i] = ToFixed(y[i]);
+        lut.inverse[i] = ToFixed(InverseValue(params, range, static_cast<double>(i) / (n - 1)));
+    }
+    return lut;
+}
+
+// output voltage of the forward table entry nearest to Vin
+inline double EvaluateLut(const lut_t &lut, double Vin)
+{
+    const double range = lut.Vmax - lut.Vmin;
+    const double x = std::min(std::max((Vin - lut.Vmin) / range, 0.), 1.) * (lut.forward.size() - 1);
+    return lut.Vmin + range * lut.forward[static_cast<size_t>(x + 0.5)] * (1. / 65535.);
+}
+
+// same, linearly interpolated between the two nearest entries
+inline double InterpolateLut(const lut_t &lut, double Vin)
+{
+    const double range = lut.Vmax - lut.Vmin;
+    const double x = std::min(std::max((Vin - lut.Vmin) / range, 0.), 1.) * (lut.forward.size() - 1);
+    const size_t i = std::min<size_t>(static_cast<size_t>(x), lut.forward.size() - 2);
+    const double y = lut.forward[i] + (x - i) * (lut.forward[i + 1] - lut.forward[i]);
+    return lut.Vmin + range * y * (1. / 65535.);
+}
+
+inline void WriteTable(std::ostream &os, const std::string &name, const std::vector<uint16_t> &table)
+{
+    os << "constexpr unsigned short " << name << "[" << table.size() << "] =" << std::endl << "{";
+    for (size_t i = 0; i < table.size(); i++)
+    {
+        if (i % 12 == 0)
+            os << std::endl << "   ";
+        os << " " << table[i] << ",";
+    }
+    os << std::endl << "};" << std::endl << std::endl;
+}
+
+/**
+ * Write the tables as a C++ header with constexpr arrays.
+ */
+inline void WriteLutHeader(std::ostream &os, const lut_t &lut, const Parameters &params, const std::string &name)
+{
+    std::string guard = name;
+    std::transform(guard.begin(), guard.end(), guard.begin(), ::toupper);
+    guard += "_LUT_H";
+
+    os.precision(std::numeric_limits<double>::max_digits10);
+    os << "// Generated by opamp, do not edit" << std::endl;
+    os << "//" << std::endl;
+    std::string p = params.toString();
+    for (size_t pos; (pos = p.find('\n')) != std::string::npos; p.erase(0, pos + 1))
+        os << "// " << p.substr(0, pos) << std::endl;
+    os << std::endl;
+    os << "#ifndef " << guard << std::endl;
+    os << "#define " << guard << std::endl << std::endl;
+    os << "constexpr double " << name << "_vmin = " << lut.Vmin << ";" << std::endl;
+    os << "constexpr double " << name << "_vmax = " << lut.Vmax << ";" << std::endl;
+    os << "constexpr unsigned int " << name << "_bits = " << lut.bits << ";" << std::endl << std::endl;
+    os << "// output voltage indexed by input voltage" << std::endl;
+    WriteTable(os, name + "_lut", lut.forward);
+    os << "// input voltage indexed by output voltage" << std::endl;
+    WriteTable(os, name + "_inverse_lut", lut.inverse);
+    os << "#endif" << std::endl;
+}
+
+/**
+ * Write the tables as a binary blob, all values little endian:
+ *
+ *   char[8]  magic "OPAMPLUT"
+ *   uint32   version (1)
+ *   uint32   bits, the tables have 2^bits entries
+ *   double   Vmin
+ *   double   Vmax
+ *   uint16[] forward table
+ *   uint16[] inverse table
+ */
+inline void WriteLutBinary(std::ostream &os, const lut_t &lut)
+{
+    auto put = [&os](uint64_t value, int bytes) {
+        for (int i = 0; i < bytes; i++)
+            os.put(static_cast<char>((value >> (i * 8)) & 0xff));
+    };
+    auto putDouble = [&put](double d) {
+        uint64_t bits;
+        std::memcpy(&bits, &d, sizeof(bits));
+        put(bits, 8);
+    };
+
+    os.write("OPAMPLUT", 8);
+    put(1, 4);
+    put(lut.bits, 4);
+    putDouble(lut.Vmin);
+    putDouble(lut.Vmax);
+    for (uint16_t v: lut.forward)
+        put(v, 2);
+    for (uint16_t v: lut.inverse)
+        put(v, 2);
+}
+
+#endif
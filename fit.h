@@ -0,0 +1,376 @@
+/*
+ * This file is part of libsidplayfp, a SID player engine.
+ *
+ * Copyright 2023 Leandro Nini <drfiemost@users.sourceforge.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef FIT_H
+#define FIT_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "parameters.h"
+#include "reference.h"
+#include "random.h"
+#include "optimizer.h"
+#include "refine.h"
+#include "reporter.h"
+#include "checkpoint.h"
+#include "sweep.h"
+
+/*
+ * The fitter as a library: Fit() runs the whole pipeline of the
+ * command line tool on a dataset and returns the result, errors
+ * included, so it can be called in process and from several
+ * threads at once.
+ *
+ * All the state of a fit is local to the call, the random generators
+ * included: the fit draws the island seeds from its own and each
+ * search chain has one, all of them seeded from config.seed.
+ */
+
+struct fit_options_t
+{
+    config_t config;
+    // logistic starting point, the sweeps may replace it
+    Parameters initial;
+    // progress records, called on a background thread; if not set
+    // they are formatted to out as config.output says, or dropped
+    std::function<void(const report_t&)> progress;
+    std::ostream* out = nullptr;
+    // print the errors of the starting point per sample to out
+    bool listing = false;
+    // the search stops gracefully when this becomes true
+    const std::atomic<bool>* cancel = nullptr;
+    // runs the sweep and search threads instead of OpenMP,
+    // config.threads of them (default: all cores)
+    executor_t executor;
+};
+
+struct fit_result_t
+{
+    // false if the fit couldn't run, the reason is in error
+    bool ok = false;
+    std::string error;
+    // of the fitted transfer function
+    Parameters params;
+    score_t score;
+    // why the search stopped, NONE if there was none
+    Stop_t reason = Stop_t::NONE;
+    stats_t stats;
+    double seconds = 0.;
+};
+
+// metric and weighted regions of the options
+inline void SetObjective(Reference &reference, const config_t &config)
+{
+    reference.setMetric(config.metric, config.huber);
+    for (const region_t &region: config.regions)
+        reference.emphasize(region);
+}
+
+/**
+ * Number of threads a fit will search on.
+ */
+inline unsigned int FitThreads(const fit_options_t &options)
+{
+    if (options.executor)
+        return options.config.threads ? options.config.threads : std::max(1u, std::thread::hardware_concurrency());
+    return SearchThreads(options.config);
+}
+
+/**
+ * Fit the model to the reference data, whose objective
+ * must already be set from the options, see SetObjective().
+ */
+inline fit_result_t Fit(const Reference &reference, const fit_options_t &options)
+{
+    const config_t &config = options.config;
+    const auto begin = std::chrono::steady_clock::now();
+    fit_result_t result;
+
+    // the starting points are logistic, sent to the fitted function
+    Parameters bestparams = Parameters::FromLogistic(options.initial, config.transfer);
+    score_t bestscore;
+
+    const unsigned int threads = FitThreads(options);
+    run_t run(threads);
+    run.cancel = options.cancel;
+    run.executor = options.executor;
+    islands_t islands;
+
+    if (config.resume && !ReadCheckpoint(config.checkpoint, config, reference, islands, run, result.error))
+        return result;
+
+    // all the output goes through the reporter from here on,
+    // it is destroyed, so all written, before returning
+    std::unique_ptr<Reporter> reporter;
+    if (options.progress)
+        reporter.reset(new Reporter(options.progress));
+    else if (options.out)
+        reporter.reset(new Reporter(*options.out, config.output));
+    else
+        reporter.reset(new Reporter([](const report_t&) {}));
+    run.reporter = reporter.get();
+
+    auto report = [](Report_t kind, const Parameters &p, const score_t &score) {
+        report_t r;
+        r.kind = kind;
+        r.setParameters(p, score);
+        return r;
+    };
+    auto refinedReport = [&report](Report_t kind, const Parameters &p, const refine_t &refined) {
+        report_t r = report(kind, p, refined.score);
+        r.count = refined.iterations;
+        r.time = refined.seconds;
+        return r;
+    };
+    auto done = [&]() {
+        result.ok = true;
+        result.params = bestparams;
+        result.score = bestscore;
+        result.reason = run.reason.load();
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        return result;
+    };
+
+    if (config.resume)
+    {
+        reporter->message("# resumed from " + config.checkpoint + " at " + std::to_string(run.trials.load()) + " trials");
+    }
+    else
+    {
+        // the best points of the sweeps, refined, are the next starting points
+        std::vector<candidate_t> swept;
+        size_t nextSwept = 0;
+
+        if (config.globalSweep)
+        {
+            // the starting point comes from the bounds alone
+            const auto start = std::chrono::steady_clock::now();
+            const std::string cache = SweepCacheFile(config, reference);
+            report_t r;
+            if (!cache.empty() && ReadSweepCache(cache, config, reference, swept))
+            {
+                r.kind = Report_t::CACHED;
+                r.count = swept.size();
+                r.text = cache;
+            }
+            else
+            {
+                uint64_t scored;
+                swept = GlobalSweep(reference, config, threads, options.executor, scored);
+                if (!cache.empty() && !swept.empty() && !WriteSweepCache(cache, config, reference, swept))
+                    reporter->message("# error writing sweep cache " + cache);
+                r.kind = Report_t::SWEEP;
+                r.count = scored;
+                r.text = SweepDevice(reference);
+            }
+            if (swept.empty())
+            {
+                result.error = "no finite score within the bounds";
+                return result;
+            }
+            r.setParameters(swept[0].params, swept[0].score);
+            r.time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            reporter->send(std::move(r));
+
+            for (candidate_t &c: swept)
+            {
+                c.params = Parameters::FromLogistic(c.params, config.transfer);
+                c.score = c.params.Score(reference, nullptr, std::numeric_limits<double>::infinity());
+            }
+            bestparams = swept[0].params;
+            nextSwept = 1;
+        }
+
+        // Calculate current score, the per sample listing goes straight to out
+        reporter->flush();
+        bestscore = bestparams.Score(reference, options.listing ? options.out : nullptr, std::numeric_limits<double>::infinity());
+        reporter->send(report(Report_t::INITIAL, bestparams, bestscore));
+
+        if (bestscore.error == 0)
+            return done();
+
+        if (config.refine)
+        {
+            // polish the starting point with a local gradient based search
+            const refine_t refined = Refine(reference, bestparams);
+            bestscore = refined.score;
+            reporter->send(refinedReport(Report_t::REFINED, bestparams, refined));
+        }
+
+        if (config.sweep)
+        {
+            const auto start = std::chrono::steady_clock::now();
+            const grid_t grid = GridAround(bestparams, config.sweepSpan, config.sweep);
+            swept = Sweep(reference, grid, config.sweepTop, threads, options.executor);
+            nextSwept = 0;
+            if (config.refine)
+            {
+                for (candidate_t &c: swept)
+                    c.score = Refine(reference, c.params).score;
+                std::stable_sort(swept.begin(), swept.end(), [](const candidate_t &a, const candidate_t &b) { return b.score.isBetter(a.score); });
+            }
+
+            if (!swept.empty())
+            {
+                report_t r = report(Report_t::SWEEP, swept[0].params, swept[0].score);
+                r.count = grid.size();
+                r.time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                r.text = SweepDevice(reference);
+                reporter->send(std::move(r));
+
+                if (bestscore.isBetter(swept[0].score))
+                {
+                    bestparams = swept[0].params;
+                    bestscore = swept[0].score;
+                    nextSwept = 1;
+                }
+            }
+        }
+
+        if (!config.search)
+            return done();
+
+        // island 0 starts from the given point, the others from
+        // the sweep or from scattered ones
+        Rng rng(config.seed ? config.seed : getSeed());
+        islands.emplace_back(new SharedBest(bestparams, bestscore));
+        for (unsigned int i = 1; i < config.islands; i++)
+        {
+            Parameters seed;
+            score_t seedscore;
+            if (nextSwept < swept.size())
+            {
+                seed = swept[nextSwept].params;
+                seedscore = swept[nextSwept++].score;
+            }
+            else
+            {
+                seed = IslandSeed(rng, bestparams);
+                seedscore = seed.Score(reference, nullptr, std::numeric_limits<double>::infinity());
+                if (config.refine)
+                    seedscore = Refine(reference, seed).score;
+            }
+            report_t r = report(Report_t::SEED, seed, seedscore);
+            r.index = i;
+            reporter->send(std::move(r));
+            islands.emplace_back(new SharedBest(seed, seedscore));
+        }
+
+        run.start = std::chrono::steady_clock::now();
+    }
+
+    bool parallel = static_cast<bool>(options.executor);
+#ifdef _OPENMP
+    parallel = true;
+#endif
+    if (parallel)
+    {
+        report_t r;
+        r.kind = Report_t::RUNNING;
+        r.count = threads;
+        reporter->send(std::move(r));
+    }
+
+    if (!config.checkpoint.empty())
+    {
+        run.checkpointInterval = config.checkpointInterval;
+        run.checkpoint = [&](const run_t &r) {
+            if (!WriteCheckpoint(config.checkpoint, config, reference, islands, r))
+                reporter->message("# error writing checkpoint " + config.checkpoint);
+        };
+    }
+
+    Search(reference, config, islands, run);
+
+    if (run.checkpoint)
+        run.checkpoint(run);
+
+    // final summary
+    const double elapsed = run.elapsed();
+    const size_t best = BestIsland(islands, bestparams, bestscore);
+    result.stats = run.total();
+    {
+        report_t r;
+        r.kind = Report_t::STOPPED;
+        r.text = toString(run.reason.load());
+        reporter->send(std::move(r));
+    }
+    {
+        report_t r;
+        r.kind = Report_t::TOTAL;
+        r.stats = result.stats;
+        r.time = elapsed;
+        reporter->send(std::move(r));
+    }
+    if (threads > 1)
+    {
+        for (unsigned int i = 0; i < threads; i++)
+        {
+            report_t r;
+            r.kind = Report_t::THREAD;
+            r.index = i;
+            r.total = threads;
+            run.counters[i].accumulate(r.stats);
+            r.time = elapsed;
+            reporter->send(std::move(r));
+        }
+    }
+    if (islands.size() > 1)
+    {
+        for (size_t i = 0; i < islands.size(); i++)
+        {
+            Parameters p;
+            score_t s;
+            islands[i]->read(p, s);
+            report_t r = report(Report_t::ISLAND, p, s);
+            r.index = i;
+            r.total = islands.size();
+            reporter->send(std::move(r));
+        }
+        report_t r;
+        r.kind = Report_t::BEST_ISLAND;
+        r.index = best;
+        r.total = islands.size();
+        reporter->send(std::move(r));
+    }
+    reporter->send(report(Report_t::BEST, bestparams, bestscore));
+
+    if (config.refine && bestscore.error != 0)
+    {
+        // polish the Monte Carlo best
+        const refine_t refined = Refine(reference, bestparams);
+        bestscore = refined.score;
+        reporter->send(refinedReport(Report_t::FINAL, bestparams, refined));
+    }
+
+    return done();
+}
+
+#endif
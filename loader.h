@@ -0,0 +1,419 @@
+/*
+ * This file is part of libsidplayfp, a SID player engine.
+ *
+ * Copyright 2023 Leandro Nini <drfiemost@users.sourceforge.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef LOADER_H
+#define LOADER_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+
+#include <algorithm>
+#include <charconv>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#  define HAVE_MMAP
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+#include "reference.h"
+
+/*
+ * Measured curves from files.
+ *
+ * CSV files hold one sample per line, input and output voltage
+ * separated by commas, semicolons, tabs or spaces; extra columns
+ * are ignored, empty lines and lines starting with # are skipped,
+ * as is a non numeric first line used as a header.
+ * A comment line "# range <Vmin> <Vmax>" sets the voltage range.
+ *
+ * Binary files, all values little endian:
+ *
+ *   char[8]  magic "OPAMPREF"
+ *   uint32   version (2)
+ *   uint32   sample type, 0 for double, 1 for float
+ *   uint64   count
+ *   double   Vmin
+ *   double   Vmax
+ *   T[count] input voltages
+ *   T[count] output voltages
+ *
+ * The header is 40 bytes so the arrays are naturally aligned
+ * and are read in place from the mapped file.
+ * Version 1 files have no range fields and a 24 bytes header.
+ *
+ * Every sample is a measurement. Without an explicit range
+ * it spans the lowest to the highest of all the input and
+ * output voltages, which share the supply range.
+ */
+
+static const char REFERENCE_MAGIC[8] = { 'O', 'P', 'A', 'M', 'P', 'R', 'E', 'F' };
+static const size_t REFERENCE_HEADER_V1 = 24;
+static const size_t REFERENCE_HEADER = 40;
+
+/**
+ * Read only view of a whole file, memory mapped where available.
+ */
+class MappedFile
+{
+private:
+    const char* base;
+    size_t length;
+#ifdef HAVE_MMAP
+    void* map;
+#else
+    std::vector<char> buffer;
+#endif
+
+public:
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    explicit MappedFile(const std::string &file) :
+        base(nullptr),
+        length(0)
+#ifdef HAVE_MMAP
+        , map(MAP_FAILED)
+#endif
+    {
+#ifdef HAVE_MMAP
+        const int fd = ::open(file.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat st;
+        if (::fstat(fd, &st) == 0)
+        {
+            length = st.st_size;
+            static const char empty = 0;
+            if (length == 0)
+                base = &empty;
+            else if ((map = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED)
+                base = static_cast<const char*>(map);
+        }
+        ::close(fd);
+#else
+        FILE* f = std::fopen(file.c_str(), "rb");
+        if (!f)
+            return;
+        char chunk[1 << 16];
+        size_t r;
+        while ((r = std::fread(chunk, 1, sizeof(chunk), f)) > 0)
+            buffer.insert(buffer.end(), chunk, chunk + r);
+        if (!std::ferror(f))
+        {
+            buffer.push_back(0);
+            base = buffer.data();
+            length = buffer.size() - 1;
+        }
+        std::fclose(f);
+#endif
+    }
+
+    ~MappedFile()
+    {
+#ifdef HAVE_MMAP
+        if (map != MAP_FAILED)
+            ::munmap(map, length);
+#endif
+    }
+
+    bool ok() const { return base != nullptr; }
+    const char* data() const { return base; }
+    size_t size() const { return length; }
+};
+
+inline bool IsLittleEndian()
+{
+    const uint16_t one = 1;
+    unsigned char c;
+    std::memcpy(&c, &one, 1);
+    return c == 1;
+}
+
+template<typename T>
+inline bool CheckSamples(const T* Vin, const T* Vout, size_t n, std::string &error)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        if (!std::isfinite(Vin[i]) || !std::isfinite(Vout[i]) || !(Vout[i] > 0))
+        {
+            error = "invalid sample " + std::to_string(i);
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * The voltage range covered by the samples.
+ */
+template<typename T>
+inline void SampleRange(const T* Vin, const T* Vout, size_t n, double &Vmin, double &Vmax)
+{
+    Vmin = Vmax = Vin[0];
+    for (size_t i = 0; i < n; i++)
+    {
+        Vmin = std::min({ Vmin, static_cast<double>(Vin[i]), static_cast<double>(Vout[i]) });
+        Vmax = std::max({ Vmax, static_cast<double>(Vin[i]), static_cast<double>(Vout[i]) });
+    }
+}
+
+inline bool CheckRange(double Vmin, double Vmax, std::string &error)
+{
+    if (!std::isfinite(Vmin) || !std::isfinite(Vmax) || !(Vmin < Vmax))
+    {
+        error = "invalid voltage range";
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Parse CSV samples in [begin, end), with the voltage range
+ * of the range line or of the samples.
+ *
+ * @return false on error, with a description in error
+ */
+inline bool ParseCsv(const char* begin, const char* end, std::vector<double> &Vin, std::vector<double> &Vout, double &Vmin, double &Vmax, std::string &error)
+{
+    auto isSeparator = [](char c) { return c == ',' || c == ';' || c == ' ' || c == '\t' || c == '\r'; };
+
+    // reads up to count numbers, returns how many
+    auto parseNumbers = [&isSeparator](const char* &c, const char* eol, double* v, int count) {
+        int fields = 0;
+        while (fields < count && c < eol)
+        {
+            if (*c == '+')
+                c++;
+            const std::from_chars_result r = std::from_chars(c, eol, v[fields]);
+            if (r.ec != std::errc() || (r.ptr < eol && !isSeparator(*r.ptr)))
+                break;
+            fields++;
+            c = r.ptr;
+            while (c < eol && isSeparator(*c))
+                c++;
+        }
+        return fields;
+    };
+
+    static const char RANGE[] = "range";
+    static const size_t RANGE_LENGTH = sizeof(RANGE) - 1;
+
+    unsigned int line = 0;
+    bool first = true;
+    bool hasRange = false;
+    for (const char* p = begin; p < end;)
+    {
+        const char* eol = static_cast<const char*>(std::memchr(p, '\n', end - p));
+        if (!eol)
+            eol = end;
+        line++;
+
+        const char* c = p;
+        p = eol + 1;
+
+        while (c < eol && isSeparator(*c))
+            c++;
+        if (c == eol)
+            continue;
+
+        double v[2];
+        if (*c == '#')
+        {
+            c++;
+            while (c < eol && isSeparator(*c))
+                c++;
+            if (static_cast<size_t>(eol - c) <= RANGE_LENGTH || std::memcmp(c, RANGE, RANGE_LENGTH) != 0 || !isSeparator(c[RANGE_LENGTH]))
+                continue;
+            c += RANGE_LENGTH;
+            while (c < eol && isSeparator(*c))
+                c++;
+            if (hasRange || parseNumbers(c, eol, v, 2) < 2 || c != eol)
+            {
+                error = "line " + std::to_string(line) + ": expected a single range <Vmin> <Vmax>";
+                return false;
+            }
+            hasRange = true;
+            Vmin = v[0];
+            Vmax = v[1];
+            continue;
+        }
+
+        if (parseNumbers(c, eol, v, 2) < 2)
+        {
+            // column names
+            if (first)
+            {
+                first = false;
+                continue;
+            }
+            error = "line " + std::to_string(line) + ": expected two numbers";
+            return false;
+        }
+        first = false;
+
+        Vin.push_back(v[0]);
+        Vout.push_back(v[1]);
+    }
+
+    if (Vin.empty())
+    {
+        error = "no samples";
+        return false;
+    }
+    if (!CheckSamples(Vin.data(), Vout.data(), Vin.size(), error))
+        return false;
+    if (!hasRange)
+        SampleRange(Vin.data(), Vout.data(), Vin.size(), Vmin, Vmax);
+    return CheckRange(Vmin, Vmax, error);
+}
+
+/**
+ * Build the reference from a binary file held in memory.
+ */
+inline std::unique_ptr<Reference> LoadBinary(const char* data, size_t size, std::string &error)
+{
+    if (!IsLittleEndian())
+    {
+        error = "binary files are only supported on little endian hosts";
+        return nullptr;
+    }
+    if (size < REFERENCE_HEADER_V1)
+    {
+        error = "truncated header";
+        return nullptr;
+    }
+
+    uint32_t version, type;
+    uint64_t count;
+    std::memcpy(&version, data + 8, 4);
+    std::memcpy(&type, data + 12, 4);
+    std::memcpy(&count, data + 16, 8);
+
+    if (version < 1 || version > 2 || type > 1)
+    {
+        error = "unsupported version or sample type";
+        return nullptr;
+    }
+
+    const size_t header = version == 1 ? REFERENCE_HEADER_V1 : REFERENCE_HEADER;
+    if (size < header)
+    {
+        error = "truncated header";
+        return nullptr;
+    }
+
+    const size_t sample = type == 0 ? sizeof(double) : sizeof(float);
+    if (count == 0 || count > (size - header) / (2 * sample) || header + 2 * count * sample != size)
+    {
+        error = "size does not match the sample count";
+        return nullptr;
+    }
+
+    auto build = [&](auto* Vin) -> std::unique_ptr<Reference> {
+        const auto* Vout = Vin + count;
+        if (!CheckSamples(Vin, Vout, count, error))
+            return nullptr;
+        double Vmin, Vmax;
+        if (version == 1)
+            SampleRange(Vin, Vout, count, Vmin, Vmax);
+        else
+        {
+            std::memcpy(&Vmin, data + 24, 8);
+            std::memcpy(&Vmax, data + 32, 8);
+        }
+        if (!CheckRange(Vmin, Vmax, error))
+            return nullptr;
+        return std::unique_ptr<Reference>(new Reference(Vin, Vout, count, Vmin, Vmax));
+    };
+
+    const char* arrays = data + header;
+    if (type == 0)
+        return build(reinterpret_cast<const double*>(arrays));
+    else
+        return build(reinterpret_cast<const float*>(arrays));
+}
+
+/**
+ * Load a measured curve, binary files are recognized by their magic,
+ * anything else is parsed as CSV.
+ *
+ * @return nullptr on error, with a description in error
+ */
+inline std::unique_ptr<Reference> LoadReference(const std::string &file, std::string &error)
+{
+    const MappedFile mapped(file);
+    if (!mapped.ok())
+    {
+        error = "cannot read " + file;
+        return nullptr;
+    }
+
+    const char* data = mapped.data();
+    const size_t size = mapped.size();
+
+    if (size >= sizeof(REFERENCE_MAGIC) && std::memcmp(data, REFERENCE_MAGIC, sizeof(REFERENCE_MAGIC)) == 0)
+        return LoadBinary(data, size, error);
+
+    std::vector<double> Vin, Vout;
+    double Vmin, Vmax;
+    if (!ParseCsv(data, data + size, Vin, Vout, Vmin, Vmax, error))
+        return nullptr;
+    return std::unique_ptr<Reference>(new Reference(Vin.data(), Vout.data(), Vin.size(), Vmin, Vmax));
+}
+
+/**
+ * Write the reference samples and range in the binary format, as doubles.
+ * The input voltages are rebuilt as x + Vmin.
+ */
+inline void WriteReferenceBinary(std::ostream &os, const Reference &reference)
+{
+    auto put = [&os](uint64_t value, int bytes) {
+        for (int i = 0; i < bytes; i++)
+            os.put(static_cast<char>((value >> (i * 8)) & 0xff));
+    };
+    auto putDouble = [&put](double d) {
+        uint64_t bits;
+        std::memcpy(&bits, &d, sizeof(bits));
+        put(bits, 8);
+    };
+
+    const size_t n = reference.size();
+    os.write(REFERENCE_MAGIC, sizeof(REFERENCE_MAGIC));
+    put(2, 4);
+    put(0, 4);
+    put(n, 8);
+    putDouble(reference.getVmin());
+    putDouble(reference.getVmax());
+    for (size_t i = 0; i < n; i++)
+        putDouble(reference.getX()[i] + reference.getVmin());
+    for (size_t i = 0; i < n; i++)
+        putDouble(reference.getVout()[i]);
+}
+
+#endif
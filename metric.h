@@ -0,0 +1,216 @@
+/*
+ * This file is part of libsidplayfp, a SID player engine.
+ *
+ * Copyright 2023 Leandro Nini <drfiemost@users.sourceforge.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef METRIC_H
+#define METRIC_H
+
+#include <cmath>
+#include <string>
+
+#include "simd.h"
+
+/**
+ * Error metrics, the reductions of the weighted residuals
+ * (Vsim - Vref)*weight into the score of a candidate.
+ *
+ * Each one is a per lane accumulator: in Parameters::Score() the lanes
+ * hold W samples of one candidate and are reduced at the end, in the
+ * batched loops they hold W candidates. The sums are compensated,
+ * so the result hardly depends on how the samples are split between
+ * the lanes, and the partial values only grow, which the early exit
+ * on the bound needs.
+ *
+ * WithMetric() picks the instance from the runtime id,
+ * as WithTransfer() does for the transfer functions.
+ */
+
+enum class Metric_t
+{
+    // root of the sum of squares
+    L2,
+    // square root of twice the Huber loss, equal to L2 while
+    // all the residuals are below delta
+    HUBER,
+    // largest absolute residual, what matters for the tables
+    MAX_ABS
+};
+
+/**
+ * Blocked compensated summation of the per sample terms, lane by lane:
+ * plain sums over blocks of BLOCK terms, added to the total with
+ * Knuth's TwoSum, whose exact rounding errors go to a second sum.
+ * Per term it costs no more than a plain sum, tables shorter than
+ * a block per lane get the plain sum itself, and the longer ones
+ * stay within a ulp or two however the samples are split.
+ */
+struct CompensatedSum
+{
+    static constexpr int BLOCK = 16;
+
+    simd::vdouble block = 0.;
+    simd::vdouble sum = 0.;
+    simd::vdouble c = 0.;
+    int count = 0;
+
+    static SIMD_INLINE void twoSum(simd::vdouble a, simd::vdouble b, simd::vdouble &s, simd::vdouble &e)
+    {
+        s = a + b;
+        const simd::vdouble t = s - a;
+        e = (a - (s - t)) + (b - t);
+    }
+
+    SIMD_INLINE void accumulate(simd::vdouble term)
+    {
+        block = block + term;
+        if (++count == BLOCK)
+        {
+            simd::vdouble e;
+            twoSum(sum, block, sum, e);
+            c = c + e;
+            block = 0.;
+            count = 0;
+        }
+    }
+
+    // growing partial value, compared with bound()
+    simd::vdouble partial() const { return sum + block; }
+
+    simd::vdouble total() const
+    {
+        simd::vdouble s, e;
+        twoSum(sum, block, s, e);
+        return s + (c + e);
+    }
+
+    static double reduce(simd::vdouble lanes) { return simd::hsum(lanes); }
+
+    static double bound(double score) { return score * score; }
+    static double finish(double total) { return std::sqrt(total); }
+    static simd::vdouble finish(simd::vdouble total) { return simd::sqrt(total); }
+};
+
+struct SquaredError : CompensatedSum
+{
+    static constexpr Metric_t id = Metric_t::L2;
+    static constexpr const char* name = "l2";
+
+    explicit SquaredError(double = 0.) {}
+
+    SIMD_INLINE void add(simd::vdouble diff) { accumulate(diff * diff); }
+};
+
+struct HuberError : CompensatedSum
+{
+    static constexpr Metric_t id = Metric_t::HUBER;
+    static constexpr const char* name = "huber";
+
+    simd::vdouble delta;
+
+    explicit HuberError(double d) : delta(d) {}
+
+    // 2*huber(r) = r^2 below delta, delta*(2|r| - delta) above
+    SIMD_INLINE void add(simd::vdouble diff)
+    {
+        const simd::vdouble r = simd::abs(diff);
+        const simd::vdouble m = simd::min(r, delta);
+        accumulate(m * (r + r - m));
+    }
+};
+
+struct MaxAbsError
+{
+    static constexpr Metric_t id = Metric_t::MAX_ABS;
+    static constexpr const char* name = "max";
+
+    simd::vdouble max = 0.;
+    // zero, or NaN after a NaN residual which max() would drop
+    simd::vdouble nan = 0.;
+
+    explicit MaxAbsError(double = 0.) {}
+
+    SIMD_INLINE void add(simd::vdouble diff)
+    {
+        max = simd::max(max, simd::abs(diff));
+        nan = nan + (diff - diff);
+    }
+
+    simd::vdouble partial() const { return max; }
+    simd::vdouble total() const { return max + nan; }
+
+    static double reduce(simd::vdouble lanes) { return simd::hmax(lanes) + (simd::hsum(lanes) - simd::hsum(lanes)); }
+
+    static double bound(double score) { return score; }
+    static double finish(double total) { return total; }
+    static simd::vdouble finish(simd::vdouble total) { return total; }
+};
+
+template<typename M, typename F>
+SIMD_NOINLINE auto CallMetric(F f, double delta)
+{
+    return f(M(delta));
+}
+
+/**
+ * Call f with an instance of the metric,
+ * delta is the threshold of the Huber loss.
+ * Only the squared error, the default, is inlined in the caller.
+ */
+template<typename F>
+inline auto WithMetric(Metric_t m, double delta, F f)
+{
+    switch (m)
+    {
+    case Metric_t::HUBER:
+        return CallMetric<HuberError>(f, delta);
+    case Metric_t::MAX_ABS:
+        return CallMetric<MaxAbsError>(f, delta);
+    case Metric_t::L2:
+    default:
+        return f(SquaredError(delta));
+    }
+}
+
+inline const char* toString(Metric_t m)
+{
+    return WithMetric(m, 0., [](auto metric) { return decltype(metric)::name; });
+}
+
+inline bool ParseMetric(const std::string &name, Metric_t &m)
+{
+    for (Metric_t i: { Metric_t::L2, Metric_t::HUBER, Metric_t::MAX_ABS })
+    {
+        if (name == toString(i))
+        {
+            m = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Range of input voltages whose weights are multiplied by weight
+struct region_t
+{
+    double lo;
+    double hi;
+    double weight;
+};
+
+#endif
@@ -0,0 +1,171 @@
+/*
+ * This file is part of libsidplayfp, a SID player engine.
+ *
+ * Copyright 2023 Leandro Nini <drfiemost@users.sourceforge.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef MODEL_H
+#define MODEL_H
+
+#include <cmath>
+#include <cstddef>
+#include <algorithm>
+#include <iterator>
+
+#include "simd.h"
+#include "parameters.h"
+#include "reference.h"
+#include "chips.h"
+
+// let the compiler unroll the loops over the fixed size tables
+#if defined(__clang__)
+#  define MODEL_UNROLL _Pragma("unroll")
+#elif defined(__GNUC__)
+#  define MODEL_UNROLL _Pragma("GCC unroll 64")
+#else
+#  define MODEL_UNROLL
+#endif
+
+/**
+ * Scoring specialized at compile time for one of the built-in tables.
+ *
+ * The shifted inputs, outputs and weights are computed by the compiler
+ * and the sample count is a constant, so the loops over the 33 and 21
+ * point tables can be fully unrolled, with an instance for each transfer
+ * function. The arithmetic is the same as in Parameters::Score() and
+ * ScoreBatchGeneric(), in the same order, so the scores are bit identical.
+ * Only the squared error is specialized, see Reference::setMetric().
+ */
+template<typename Chip>
+class Model
+{
+public:
+    static constexpr std::size_t W = simd::vdouble::width;
+    static constexpr std::size_t size = std::size(Chip::table);
+    static constexpr std::size_t padded = (size + W - 1) / W * W;
+
+    static constexpr double Vmin = Chip::table[0].Vin;
+    static constexpr double Vmax = Chip::table[0].Vout;
+    static constexpr double range = Vmax - Vmin;
+
+private:
+    // same layout as Reference, with zero weight padding
+    struct tables_t
+    {
+        alignas(64) double x[padded];
+        alignas(64) double vout[padded];
+        alignas(64) double weight[padded];
+    };
+
+    static constexpr tables_t build()
+    {
+        tables_t t {};
+        for (std::size_t i = 0; i < size; i++)
+        {
+            t.x[i] = Chip::table[i].Vin - Vmin;
+            t.vout[i] = Chip::table[i].Vout;
+            t.weight[i] = 1. / Chip::table[i].Vout;
+        }
+        return t;
+    }
+
+    static constexpr tables_t tables = build();
+
+    template<typename T>
+    static score_t Score(const Parameters &params, double bestscore)
+    {
+        const double bound = SquaredError::bound(bestscore);
+        simd::vdouble c[T::C];
+        params.Prepare<T>(c);
+
+        SquaredError error;
+
+        MODEL_UNROLL
+        for (std::size_t i = 0; i < padded; i += W)
+        {
+            const simd::vdouble simval = simd::fma(T::kernel(simd::vdouble::load(tables.x + i), c), range, Vmin);
+            error.add(Parameters::GetResidual(simval, simd::vdouble::load(tables.vout + i), simd::vdouble::load(tables.weight + i)));
+
+            if (SquaredError::reduce(error.partial()) > bound)
+                break;
+        }
+
+        score_t score;
+        score.error = SquaredError::finish(SquaredError::reduce(error.total()));
+        return score;
+    }
+
+    template<typename T>
+    static void ScoreBatch(const Parameters* params, score_t* scores, std::size_t K, double bestscore)
+    {
+        const simd::vdouble bound = SquaredError::bound(bestscore);
+
+        for (std::size_t k = 0; k < K; k += W)
+        {
+            simd::vdouble c[T::C];
+            PrepareBatch<T>(params, k, K, c);
+
+            SquaredError error;
+
+            MODEL_UNROLL
+            for (std::size_t i = 0; i < size; i++)
+            {
+                const simd::vdouble simval = simd::fma(T::kernel(simd::vdouble(tables.x[i]), c), range, Vmin);
+                error.add(Parameters::GetResidual(simval, tables.vout[i], tables.weight[i]));
+
+                if (simd::all(error.partial() > bound))
+                    break;
+            }
+
+            alignas(64) double result[W];
+            SquaredError::finish(error.total()).store(result);
+            for (std::size_t j = 0; j < std::min<std::size_t>(W, K - k); j++)
+            {
+                scores[k + j].error = result[j];
+            }
+        }
+    }
+
+public:
+    /**
+     * Parameters::Score() without printing.
+     */
+    static score_t Score(const Parameters &params, double bestscore)
+    {
+        return WithTransfer(params.transfer, [&](auto model) { return Score<decltype(model)>(params, bestscore); });
+    }
+
+    /**
+     * ScoreBatchGeneric() over the compiled-in table.
+     */
+    static void ScoreBatch(const Parameters* params, score_t* scores, std::size_t K, double bestscore)
+    {
+        WithTransfer(params[0].transfer, [&](auto model) { ScoreBatch<decltype(model)>(params, scores, K, bestscore); });
+    }
+
+    /**
+     * The chip table as a Reference which scores with this model.
+     */
+    static Reference reference()
+    {
+        Reference reference(ref_vector_t(std::begin(Chip::table), std::end(Chip::table)));
+        reference.setKernels(&Score, &ScoreBatch);
+        return reference;
+    }
+};
+
+#endif
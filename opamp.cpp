@@ -19,7 +19,7 @@
  */
 
 #include <cassert>
-#include <ctime>
+#include <csignal>
 #include <cstdlib>
 
 #include <iostream>
@@ -28,263 +28,727 @@
 #include <string>
 #include <vector>
 #include <limits>
-#include <random>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <atomic>
+#include <utility>
+#include <mutex>
+#include <thread>
+#include <filesystem>
 
 #include "parameters.h"
+#include "reference.h"
+#include "chips.h"
+#include "model.h"
+#include "optimizer.h"
+#include "refine.h"
+#include "export.h"
+#include "spline.h"
+#include "loader.h"
+#include "batch.h"
+#include "checkpoint.h"
+#include "device.h"
+#include "sweep.h"
+#include "fit.h"
+#include "sensitivity.h"
 
 /**
- * This is the SID 6581 op-amp voltage transfer function, measured on
- * CAP1B/CAP1A on a chip marked MOS 6581R4AR 0687 14.
- * All measured chips have op-amps with output voltages (and thus input
- * voltages) within the range of 0.81V - 10.31V.
+ * Export the fitted curve as lookup tables,
+ * a C++ header if the file name ends with .h, a binary blob otherwise.
  */
-const std::vector<data_t> opamp_voltage6581 =
+static void ExportLut(const Reference &reference, const Parameters &params, const std::string &file, unsigned int bits, int chip, std::ostream &log)
 {
-  {  0.81, 10.31 },  // Approximate start of actual range
-  {  2.40, 10.31 },
-  {  2.60, 10.30 },
-  {  2.70, 10.29 },
-  {  2.80, 10.26 },
-  {  2.90, 10.17 },
-  {  3.00, 10.04 },
-  {  3.10,  9.83 },
-  {  3.20,  9.58 },
-  {  3.30,  9.32 },
-  {  3.50,  8.69 },
-  {  3.70,  8.00 },
-  {  4.00,  6.89 },
-  {  4.40,  5.21 },
-  {  4.54,  4.54 },  // Working point (vi = vo)
-  {  4.60,  4.19 },
-  {  4.80,  3.00 },
-  {  4.90,  2.30 },  // Change of curvature
-  {  4.95,  2.03 },
-  {  5.00,  1.88 },
-  {  5.05,  1.77 },
-  {  5.10,  1.69 },
-  {  5.20,  1.58 },
-  {  5.40,  1.44 },
-  {  5.60,  1.33 },
-  {  5.80,  1.26 },
-  {  6.00,  1.21 },
-  {  6.40,  1.12 },
-  {  7.00,  1.02 },
-  {  7.50,  0.97 },
-  {  8.50,  0.89 },
-  { 10.00,  0.81 },
-  { 10.31,  0.81 },  // Approximate end of actual range
-};
+    const lut_t lut = BuildLut(params, reference, bits);
+
+    const bool header = file.size() > 2 && file.compare(file.size() - 2, 2, ".h") == 0;
+    std::ofstream os(file, header ? std::ios::out : std::ios::out | std::ios::binary);
+    if (header)
+        WriteLutHeader(os, lut, params, "opamp_" + std::to_string(chip));
+    else
+        WriteLutBinary(os, lut);
+
+    if (!os)
+    {
+        log << "Error writing " << file << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    log << "# exported " << lut.forward.size() << " entry tables to " << file << std::endl;
+}
 
 /**
- * This is the SID 8580 op-amp voltage transfer function, measured on
- * CAP1B/CAP1A on a chip marked CSG 8580R5 1690 25.
+ * Read sampled values for specific waveform and chip
+ * and prepare them for scoring.
  */
-const std::vector<data_t> opamp_voltage8580 =
+static Reference ReadChip(int chip, std::ostream &log)
 {
-    {  1.30,  8.91 },  // Approximate start of actual range
-    {  4.76,  8.91 },
-    {  4.77,  8.90 },
-    {  4.78,  8.88 },
-    {  4.785, 8.86 },
-    {  4.79,  8.80 },
-    {  4.795, 8.60 },
-    {  4.80,  8.25 },
-    {  4.805, 7.50 },
-    {  4.81,  6.10 },
-    {  4.815, 4.05 },  // Change of curvature
-    {  4.82,  2.27 },
-    {  4.825, 1.65 },
-    {  4.83,  1.55 },
-    {  4.84,  1.47 },
-    {  4.85,  1.43 },
-    {  4.87,  1.37 },
-    {  4.90,  1.34 },
-    {  5.00,  1.30 },
-    {  5.10,  1.30 },
-    {  8.91,  1.30 },  // Approximate end of actual range
-};
-
-static const double EPSILON = 1e-6;
-
-#ifdef __MINGW32__
-// MinGW's std::random_device is a PRNG seeded with a constant value
-// so we use system time as a random seed.
-#include <chrono>
-inline long getSeed()
-{
-    using namespace std::chrono;
-    const auto now_ms = time_point_cast<std::chrono::milliseconds>(system_clock::now());
-    return now_ms.time_since_epoch().count();
+    log << "Reading chip: " << chip << std::endl;
+
+    switch (chip) {
+    case Chip6581::id:
+        return Model<Chip6581>::reference();
+    case Chip8580::id:
+        return Model<Chip8580>::reference();
+    default:
+        log << "Error!" << std::endl;
+        exit(EXIT_FAILURE);
+    }
 }
-#else
-inline long getSeed()
+
+/**
+ * Read a measured curve from a CSV or binary file.
+ */
+static Reference ReadFile(const std::string &file, std::ostream &log)
 {
-    return std::random_device{}();
+    log << "Reading file: " << file << std::endl;
+
+    std::string error;
+    std::unique_ptr<Reference> reference = LoadReference(file, error);
+    if (!reference)
+    {
+        log << "Error: " << error << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    log << "# " << reference->size() << " samples" << std::endl;
+    return std::move(*reference);
 }
-#endif
 
-static std::default_random_engine prng(getSeed());
-static std::normal_distribution<> normal_dist(1.0, 0.00001);
-static std::normal_distribution<> normal_dist2(0.5, 0.2);
+// set from the signal handler to stop the fits gracefully
+static std::atomic<bool> interrupted(false);
+
+// stop criterion of the batch fits when none is given
+static const uint64_t BATCH_STAGNATION = 1 << 24;
 
-static double GetRandomValue()
+/**
+ * Fit all the datasets of a list file or directory on a pool of threads,
+ * writing a results file per dataset and a summary table to outDir.
+ */
+static void RunBatch(const std::string &path, const std::string &outDir, const config_t &config, int chip, const Parameters* start)
 {
-    return normal_dist(prng);
+    std::vector<job_t> jobs;
+    std::string error;
+    if (!ListJobs(path, chip, jobs, error))
+    {
+        std::cout << "Error: " << error << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    std::error_code ec;
+    std::filesystem::create_directories(outDir, ec);
+    if (ec)
+    {
+        std::cout << "Error: " << outDir << ": " << ec.message() << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // the parallelism is across the fits
+    config_t jobConfig = config;
+    jobConfig.threads = 1;
+    jobConfig.quiet = true;
+    jobConfig.status = 0.;
+    jobConfig.checkpoint.clear();
+    jobConfig.resume = false;
+    if (!config.maxTrials && config.maxTime <= 0. && !config.stagnation)
+        jobConfig.stagnation = BATCH_STAGNATION;
+
+    const unsigned int workers = config.threads ? config.threads : std::max(1u, std::thread::hardware_concurrency());
+    const std::vector<std::string> names = ResultNames(jobs);
+    for (size_t j = 0; j < jobs.size(); j++)
+    {
+        if (names[j] != std::filesystem::path(jobs[j].file).filename().string() + ".txt")
+            std::cout << "# duplicate name, the results of " << jobs[j].file << " go to " << names[j] << std::endl;
+    }
+
+    std::cout << "# fitting " << jobs.size() << " datasets on " << std::min<size_t>(workers, jobs.size()) << " threads" << std::endl;
+
+    struct result_t
+    {
+        bool ok = false;
+        std::string error;
+        size_t samples = 0;
+        Parameters params;
+        score_t score;
+        double seconds = 0.;
+    };
+    std::vector<result_t> results(jobs.size());
+
+    std::mutex progressMutex;
+    size_t finished = 0;
+
+    RunPool(workers, jobs, [&](size_t j) {
+        const auto begin = std::chrono::steady_clock::now();
+        const job_t &job = jobs[j];
+        result_t &r = results[j];
+
+        const std::unique_ptr<Reference> reference = LoadReference(job.file, r.error);
+        if (reference)
+            SetObjective(*reference, config);
+        if (reference && job.chip != 6581 && job.chip != 8580)
+            r.error = "unknown chip " + std::to_string(job.chip);
+        else if (reference)
+        {
+            config_t c = jobConfig;
+            if (config.seed)
+                c.seed = config.seed + j;
+
+            std::ostringstream log;
+            log << "# " << job.file << ", " << reference->size() << " samples" << std::endl;
+            r.samples = reference->size();
+
+            fit_options_t options;
+            options.config = c;
+            options.initial = start ? *start : InitialParameters(job.chip);
+            options.out = &log;
+            options.cancel = &interrupted;
+            const fit_result_t fitted = Fit(*reference, options);
+            r.params = fitted.params;
+            r.score = r.params.Score(*reference, nullptr, std::numeric_limits<double>::infinity());
+            if (!fitted.ok)
+                log << "Error: " << fitted.error << std::endl;
+
+            const std::string file = (std::filesystem::path(outDir) / names[j]).string();
+            std::ofstream os(file);
+            os << log.str();
+            r.ok = fitted.ok && os;
+            if (!fitted.ok)
+                r.error = fitted.error;
+            else if (!os)
+                r.error = "cannot write " + file;
+        }
+        r.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+        std::lock_guard<std::mutex> lock(progressMutex);
+        finished++;
+        std::cout << "# [" << finished << "/" << jobs.size() << "] " << job.file << ": ";
+        if (r.ok)
+            std::cout << r.score << " in " << r.seconds << " s" << std::endl;
+        else
+            std::cout << "error, " << r.error << std::endl;
+    });
+
+    // summary, in list order
+    const std::string summary = (std::filesystem::path(outDir) / "summary.tsv").string();
+    std::ofstream os(summary);
+    os.precision(std::numeric_limits<double>::max_digits10);
+    const Parameters header(config.transfer);
+    os << "dataset\tchip\tsamples\tscore";
+    for (int i = 0; i < header.size(); i++)
+        os << "\t" << header.name(i);
+    os << "\tseconds\tstatus" << std::endl;
+    size_t failed = 0;
+    for (size_t j = 0; j < jobs.size(); j++)
+    {
+        const result_t &r = results[j];
+        os << jobs[j].file << "\t" << jobs[j].chip << "\t" << r.samples << "\t";
+        if (r.ok)
+            os << r.score.error;
+        for (int i = 0; i < header.size(); i++)
+        {
+            os << "\t";
+            if (r.ok)
+                os << r.params.theta[i];
+        }
+        os << "\t" << r.seconds << "\t" << (r.ok ? "ok" : r.error) << std::endl;
+        if (!r.ok)
+            failed++;
+    }
+    if (!os)
+    {
+        std::cout << "Error writing " << summary << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    std::cout << "# " << jobs.size() - failed << " fitted, " << failed << " failed, summary in " << summary << std::endl;
 }
 
-static double GetNewRandomValue()
+static void OnSignal(int sig)
 {
-    return static_cast<double>(normal_dist2(prng));
+    interrupted = true;
+    std::signal(sig, SIG_DFL);
 }
 
-static void Optimize(const ref_vector_t &reference, int chip)
+static void Usage(const char* name)
 {
-    Parameters bestparams;
+    std::cout << "Usage " << name << " [options] <chip>" << std::endl
+        << "Options:" << std::endl
+        << "  --proposals <K>  candidates scored together per generation (default 1)" << std::endl
+        << "  --float          screen the candidates in single precision" << std::endl
+        << "  --metric <M>     error metric: l2, huber or max (default l2)" << std::endl
+        << "  --huber <D>      threshold of the Huber loss, in relative error (default 0.05)" << std::endl
+        << "  --region <v0> <v1> <w>  multiply the weights of the samples with v0 <= Vin <= v1 by w" << std::endl
+        << "  --no-incremental score every candidate from scratch, also the ones which only change v" << std::endl
+        << "  --no-refine      skip the Levenberg-Marquardt refinement" << std::endl
+        << "  --log-q          search over log(q)" << std::endl
+        << "  --log-b          search over log(b)" << std::endl
+        << "  --max-trials <N> stop after N trials" << std::endl
+        << "  --max-time <S>   stop after S seconds" << std::endl
+        << "  --stagnation <N> stop after N trials without significant improvement" << std::endl
+        << "  --min-gain <R>   minimum relative gain of a significant improvement (default 0)" << std::endl
+        << "  --status <S>     print statistics every S seconds" << std::endl
+        << "  --threads <N>    number of worker threads (default OMP_NUM_THREADS)" << std::endl
+        << "  --seed <N>       seed of the random streams, for reproducible runs (default random)" << std::endl
+        << "  --deterministic  same results for any thread count, given seed and trial budget" << std::endl
+        << "  --lanes <N>      chains of the deterministic search (default 16)" << std::endl
+        << "  --strategy <S>   mutation strategy: fixed, adaptive or cmaes (default fixed)" << std::endl
+        << "  --model <F>      fitted function: logistic, richards or double (default logistic)" << std::endl
+        << "  --islands <M>    number of independent chains (default 1)" << std::endl
+        << "  --sweep <N>      score a grid of about N points around the starting point first" << std::endl
+        << "  --sweep-span <S> the grid spans a factor e^S either way on q, b and v (default 1)" << std::endl
+        << "  --sweep-top <K>  best points of the grid refined and used as starting points (default 8)" << std::endl
+        << "  --global-sweep   find the starting point by a coarse-to-fine sweep over the bounds" << std::endl
+        << "  --bounds <log(q)0> <log(q)1> <b0> <b1> <v0> <v1>  bounds of the global sweep" << std::endl
+        << "                   (default -1200 0 0.5 500 0.2 5)" << std::endl
+        << "  --sweep-levels <N>    levels of refinement of the global sweep (default 4)" << std::endl
+        << "  --sweep-points <N>    points per level of the global sweep (default 32768)" << std::endl
+        << "  --lhs            Latin hypercube samples instead of a grid for the global sweep" << std::endl
+        << "  --sweep-cache <dir>   cache of the global sweeps (default ~/.cache/opamp)" << std::endl
+        << "  --no-sweep-cache always run the global sweep" << std::endl
+        << "  --migrate <N>    trials between migrations of the island bests (default 1048576)" << std::endl
+        << "  --data <file>    fit the curve in a CSV or binary file, chip selects the starting point" << std::endl
+        << "  --save-data <file>    write the curve in the binary format" << std::endl
+        << "  --json           progress output as JSON lines, other messages go to stderr" << std::endl
+        << "  --checkpoint <file>   save the search state to file" << std::endl
+        << "  --checkpoint-interval <S>  seconds between checkpoints (default 60)" << std::endl
+        << "  --resume         continue the search saved in the checkpoint file" << std::endl
+        << "  --batch <path>   fit all the datasets of a list file or directory" << std::endl
+        << "  --batch-out <dir>     directory of the batch results (default batch)" << std::endl
+        << "  --params <q> <b> <v>  start from the given parameters" << std::endl
+        << "  --no-search      skip the Monte Carlo search" << std::endl
+        << "  --export-lut <file>   export lookup tables of the fitted curve" << std::endl
+        << "  --lut-bits <N>   log2 of the lookup table size (default 16)" << std::endl
+        << "  --export-spline <file>  export a piecewise cubic approximation of the fitted curve" << std::endl
+        << "  --spline-error <V>    max error of the approximation in volts (default 1e-4)" << std::endl
+        << "  --sensitivity    print the hessian, standard errors and correlations at the optimum" << std::endl
+        << "  --bootstrap <N>  also refit N bootstrap replicates of the data for confidence intervals" << std::endl
+        << "  --confidence <L> level of the bootstrap intervals (default 0.95)" << std::endl;
+    exit(EXIT_FAILURE);
+}
 
-    switch (chip)
+/**
+ * Export the fitted curve as a piecewise cubic approximation
+ * and report its accuracy and evaluation cost.
+ */
+static void ExportSpline(const Reference &reference, const Parameters &params, const std::string &file, double maxError, int chip, std::ostream &log)
+{
+    spline_t spline;
+    std::string error;
+    if (!BuildSpline(params, reference, maxError, spline, error))
     {
-    case 6581:
-        // current score 1.2889417569511381
-        bestparams.q = 5.5285312141864937e-05;
-        bestparams.b = 2.1608922897100533;
-        bestparams.v = 0.67181935418132133;
-        // current score 0.56449846890956767
-        bestparams.q = 3.984844197538005e-05;
-        bestparams.b = 3.2058605554905721;
-        bestparams.v = 1.6858924228168377;
-        break;
-    case 8580:
-        // current score 0.47707930194395543
-        bestparams.q = 2.4396355046227875e-310;
-        bestparams.b = 147.10522527455893;
-        bestparams.v = 0.01032355884323965;
-        // current score 0.1961362317665809
-        bestparams.q = 1.4286997721810887e-307;
-        bestparams.b = 201.07159005160145;
-        bestparams.v = 0.76797091115300598;
-        break;
-    default:
-        break;
+        log << "Error building the spline: " << error << std::endl;
+        exit(EXIT_FAILURE);
     }
 
-    // Calculate current score
-    score_t bestscore = bestparams.Score(reference, true, 999999999);
-    std::cout << "# initial score " << std::dec
-        << bestscore << std::endl
-        << bestparams.toString() << std::endl << std::endl;
-
-    if (bestscore.error == 0)
-        exit(EXIT_SUCCESS);
-
-    /*
-     * Start the Monte Carlo loop: we randomly alter parameters
-     * and calculate the new score until we find the best fitting
-     * function compared to the sampled data.
-     */
-    Parameters p = bestparams;
-    for (;;)
+    std::ofstream os(file);
+    WriteSplineHeader(os, spline, params, "opamp_" + std::to_string(chip));
+    if (!os)
     {
-        // loop until at least one parameter has changed
-        bool changed = false;
-        while (!changed)
-        {
-            for (Param_t i = Param_t::Q; i <= Param_t::V; i++)
-            {
-                // change a parameter with 50% proability
-                if (GetRandomValue() > 1.)
-                {
-                    const double oldValue = bestparams.GetValue(i);
-
-                    //std::cout << newValue << " -> ";
-                    double newValue = GetRandomValue()*oldValue;
-                    //double newValue = oldValue + GetRandomValue();
-                    //std::cout << newValue << std::endl;
-
-                    // avoid negative values
-                    if (newValue <= 0.f)
-                    {
-                        newValue = EPSILON;
-                    }
-                    // try to avoid too small values
-                    /*else if (newValue < EPSILON)
-                        newValue += GetNewRandomValue();*/
-
-                    p.SetValue(i, newValue);
-                    changed = changed || oldValue != newValue;
-                }
-            }
-        }
-
-        // check new score
-        const score_t score = p.Score(reference, false, bestscore.error);
-        if (bestscore.isBetter(score))
-        {
-            // accept if improvement
-            std::cout << "# current score " << std::dec
-                << score << std::endl
-                << p.toString() << std::endl << std::endl;
-            if (score.error == 0)
-                exit(EXIT_SUCCESS);
-            //p.reset();
-            bestparams = p;
-            bestscore = score;
-        }
-        else if (score.error == bestscore.error)
-        {
-            // no improvement but use new parameters as base to increase the "entropy"
-            bestparams = p;
-        }
+        log << "Error writing " << file << std::endl;
+        exit(EXIT_FAILURE);
     }
+
+    // time the evaluation on a scattered sequence of inputs
+    const int n = 1 << 20;
+    const double range = spline.Vmax - spline.Vmin;
+    double sum = 0.;
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; i++)
+        sum += EvaluateSpline(spline, spline.Vmin + range * ((i * 40503u) & (n - 1)) / n);
+    const double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / n;
+
+    log << "# exported " << spline.c.size() << " segment spline to " << file << std::endl
+        << "# max error " << spline.maxError << " V, "
+        << (spline.x.size() + 4 * spline.c.size()) * sizeof(double) << " bytes, "
+        << ns << " ns/eval (checksum " << sum << ")" << std::endl;
 }
 
 /**
- * Read sampled values for specific waveform and chip.
+ * Print the local sensitivity of the fit and, with replicates,
+ * the bootstrap intervals of the parameters.
  */
-static ref_vector_t ReadChip(int chip)
+static void AnalyzeFit(const Reference &reference, const Parameters &params, unsigned int replicates, double level, uint64_t seed, unsigned int threads, std::ostream &log)
 {
-    std::cout << "Reading chip: " << chip << std::endl;
+    if (reference.getMetric() != Metric_t::L2)
+    {
+        log << "# the sensitivity analysis assumes the l2 metric, skipped" << std::endl;
+        return;
+    }
 
-    const std::vector<data_t>* data;
-    switch (chip) {
-    case 6581:
-        data = &opamp_voltage6581;
-        break;
-    case 8580:
-        data = &opamp_voltage8580;
-        break;
-    default:
-        std::cout << "Error!" << std::endl;
-        exit(EXIT_FAILURE);
+    const int N = params.size();
+    const sensitivity_t s = Sensitivity(reference, params);
+
+    log << "# hessian of the squared score" << std::endl;
+    for (int i = 0; i < N; i++)
+    {
+        log << "#  ";
+        for (int j = 0; j < N; j++)
+            log << " " << s.hessian[i][j];
+        log << std::endl;
     }
+    log << "# standard errors";
+    for (int i = 0; i < N; i++)
+        log << (i ? ", " : " ") << params.name(i) << " " << std::sqrt(s.covariance[i][i]);
+    log << std::endl << "# correlation" << std::endl;
+    for (int i = 0; i < N; i++)
+    {
+        log << "#  ";
+        for (int j = 0; j < N; j++)
+            log << " " << s.covariance[i][j] / std::sqrt(s.covariance[i][i] * s.covariance[j][j]);
+        log << std::endl;
+    }
+
+    if (!replicates)
+        return;
 
-    ref_vector_t result;
-    for (data_t d: *data)
+    const bootstrap_t b = Bootstrap(reference, params, replicates, level, seed, threads);
+    log << "# bootstrap of " << b.replicates << " refits in " << b.seconds << " s, "
+        << 100. * b.level << "% intervals" << std::endl;
+    for (int i = 0; i < N; i++)
     {
-        result.push_back(d);
+        log << "# " << params.name(i) << " = " << b.mean[i] << " +- " << b.stddev[i]
+            << " [" << b.lo[i] << ", " << b.hi[i] << "]" << std::endl;
     }
-    return result;
 }
 
 int main(int argc, const char* argv[])
 {
-    if (argc != 2)
+    config_t config;
+    int chip = 0;
+
+    bool haveParams = false;
+    Parameters params;
+
+    std::string lutFile;
+    unsigned int lutBits = 16;
+
+    std::string dataFile;
+    std::string saveFile;
+
+    std::string batchPath;
+    std::string batchOut = "batch";
+
+    std::string splineFile;
+    double splineError = 1e-4;
+
+    std::string sweepCache;
+    bool noSweepCache = false;
+
+    bool sensitivity = false;
+    unsigned int replicates = 0;
+    double level = 0.95;
+
+    for (int i = 1; i < argc; i++)
     {
-        std::cout << "Usage " << argv[0] << " <chip>" << std::endl;
-        exit(EXIT_FAILURE);
+        const std::string arg(argv[i]);
+        if (arg == "--proposals" && i + 1 < argc)
+        {
+            config.proposals = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--float")
+        {
+            config.screen = true;
+        }
+        else if (arg == "--metric" && i + 1 < argc)
+        {
+            if (!ParseMetric(argv[++i], config.metric))
+                Usage(argv[0]);
+        }
+        else if (arg == "--huber" && i + 1 < argc)
+        {
+            config.huber = atof(argv[++i]);
+            if (!(config.huber > 0.))
+                Usage(argv[0]);
+        }
+        else if (arg == "--region" && i + 3 < argc)
+        {
+            region_t region;
+            region.lo = atof(argv[++i]);
+            region.hi = atof(argv[++i]);
+            region.weight = atof(argv[++i]);
+            if (!(region.lo <= region.hi && region.weight > 0.))
+                Usage(argv[0]);
+            config.regions.push_back(region);
+        }
+        else if (arg == "--no-incremental")
+        {
+            config.incremental = false;
+        }
+        else if (arg == "--no-refine")
+        {
+            config.refine = false;
+        }
+        else if (arg == "--log-q")
+        {
+            config.logq = true;
+        }
+        else if (arg == "--log-b")
+        {
+            config.logb = true;
+        }
+        else if (arg == "--max-trials" && i + 1 < argc)
+        {
+            config.maxTrials = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--max-time" && i + 1 < argc)
+        {
+            config.maxTime = atof(argv[++i]);
+        }
+        else if (arg == "--stagnation" && i + 1 < argc)
+        {
+            config.stagnation = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--min-gain" && i + 1 < argc)
+        {
+            config.minGain = atof(argv[++i]);
+        }
+        else if (arg == "--status" && i + 1 < argc)
+        {
+            config.status = atof(argv[++i]);
+        }
+        else if (arg == "--threads" && i + 1 < argc)
+        {
+            config.threads = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--seed" && i + 1 < argc)
+        {
+            config.seed = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--deterministic")
+        {
+            config.deterministic = true;
+        }
+        else if (arg == "--lanes" && i + 1 < argc)
+        {
+            config.lanes = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--strategy" && i + 1 < argc)
+        {
+            const std::string strategy(argv[++i]);
+            if (strategy == "fixed")
+                config.strategy = Strategy_t::FIXED;
+            else if (strategy == "adaptive")
+                config.strategy = Strategy_t::ADAPTIVE;
+            else if (strategy == "cmaes")
+                config.strategy = Strategy_t::CMAES;
+            else
+                Usage(argv[0]);
+        }
+        else if (arg == "--model" && i + 1 < argc)
+        {
+            if (!ParseTransfer(argv[++i], config.transfer))
+                Usage(argv[0]);
+        }
+        else if (arg == "--islands" && i + 1 < argc)
+        {
+            config.islands = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--migrate" && i + 1 < argc)
+        {
+            config.migrate = std::max(1ULL, strtoull(argv[++i], nullptr, 10));
+        }
+        else if (arg == "--sweep" && i + 1 < argc)
+        {
+            config.sweep = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--sweep-span" && i + 1 < argc)
+        {
+            config.sweepSpan = atof(argv[++i]);
+        }
+        else if (arg == "--sweep-top" && i + 1 < argc)
+        {
+            config.sweepTop = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--global-sweep")
+        {
+            config.globalSweep = true;
+        }
+        else if (arg == "--bounds" && i + 6 < argc)
+        {
+            for (double &b: config.bounds)
+                b = atof(argv[++i]);
+        }
+        else if (arg == "--sweep-levels" && i + 1 < argc)
+        {
+            config.sweepLevels = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--sweep-points" && i + 1 < argc)
+        {
+            config.sweepPoints = std::max(8ULL, strtoull(argv[++i], nullptr, 10));
+        }
+        else if (arg == "--lhs")
+        {
+            config.lhs = true;
+        }
+        else if (arg == "--sweep-cache" && i + 1 < argc)
+        {
+            sweepCache = argv[++i];
+        }
+        else if (arg == "--no-sweep-cache")
+        {
+            noSweepCache = true;
+        }
+        else if (arg == "--data" && i + 1 < argc)
+        {
+            dataFile = argv[++i];
+        }
+        else if (arg == "--json")
+        {
+            config.output = Output_t::JSON;
+        }
+        else if (arg == "--checkpoint" && i + 1 < argc)
+        {
+            config.checkpoint = argv[++i];
+        }
+        else if (arg == "--checkpoint-interval" && i + 1 < argc)
+        {
+            config.checkpointInterval = atof(argv[++i]);
+        }
+        else if (arg == "--resume")
+        {
+            config.resume = true;
+        }
+        else if (arg == "--batch" && i + 1 < argc)
+        {
+            batchPath = argv[++i];
+        }
+        else if (arg == "--batch-out" && i + 1 < argc)
+        {
+            batchOut = argv[++i];
+        }
+        else if (arg == "--save-data" && i + 1 < argc)
+        {
+            saveFile = argv[++i];
+        }
+        else if (arg == "--params" && i + 3 < argc)
+        {
+            params.SetValue(Logistic::Q, atof(argv[++i]));
+            params.SetValue(Logistic::B, atof(argv[++i]));
+            params.SetValue(Logistic::V, atof(argv[++i]));
+            haveParams = true;
+        }
+        else if (arg == "--no-search")
+        {
+            config.search = false;
+        }
+        else if (arg == "--export-lut" && i + 1 < argc)
+        {
+            lutFile = argv[++i];
+        }
+        else if (arg == "--lut-bits" && i + 1 < argc)
+        {
+            lutBits = std::min(std::max(2, atoi(argv[++i])), 24);
+        }
+        else if (arg == "--export-spline" && i + 1 < argc)
+        {
+            splineFile = argv[++i];
+        }
+        else if (arg == "--spline-error" && i + 1 < argc)
+        {
+            splineError = atof(argv[++i]);
+        }
+        else if (arg == "--sensitivity")
+        {
+            sensitivity = true;
+        }
+        else if (arg == "--bootstrap" && i + 1 < argc)
+        {
+            replicates = std::max(0, atoi(argv[++i]));
+        }
+        else if (arg == "--confidence" && i + 1 < argc)
+        {
+            level = atof(argv[++i]);
+            if (!(level > 0. && level < 1.))
+                Usage(argv[0]);
+        }
+        else if (arg[0] != '-' && chip == 0)
+        {
+            chip = atoi(argv[i]);
+        }
+        else
+        {
+            Usage(argv[0]);
+        }
+    }
+
+    if (chip == 0 || (config.resume && config.checkpoint.empty()))
+    {
+        Usage(argv[0]);
     }
 
-    const int chip = atoi(argv[1]);
+    const double* bounds = config.bounds;
+    if (!(bounds[0] < bounds[1] && 0. < bounds[2] && bounds[2] < bounds[3] && 0. < bounds[4] && bounds[4] < bounds[5]))
+    {
+        Usage(argv[0]);
+    }
+    if (!noSweepCache)
+        config.sweepCache = sweepCache.empty() ? DefaultSweepCache() : sweepCache;
+
     assert(chip == 6581 || chip == 8580);
 
-    ref_vector_t reference = ReadChip(chip);
+    if (config.deterministic && !config.seed)
+        config.seed = 1;
+
+    // stop gracefully, a second signal kills the process
+    std::signal(SIGINT, OnSignal);
+    std::signal(SIGTERM, OnSignal);
+
+    if (!batchPath.empty())
+    {
+        RunBatch(batchPath, batchOut, config, chip, haveParams ? &params : nullptr);
+        return EXIT_SUCCESS;
+    }
+
+    // keep stdout for the reports alone when they are machine readable
+    std::ostream &log = config.output == Output_t::JSON ? std::cerr : std::cout;
+
+    Reference reference = dataFile.empty() ? ReadChip(chip, log) : ReadFile(dataFile, log);
+    SetObjective(reference, config);
+    if (reference.objective() != toString(Metric_t::L2))
+        log << "# objective " << reference.objective() << std::endl;
+
+    if (!saveFile.empty())
+    {
+        std::ofstream os(saveFile, std::ios::out | std::ios::binary);
+        WriteReferenceBinary(os, reference);
+        if (!os)
+        {
+            log << "Error writing " << saveFile << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
 
 #ifndef NDEBUG
-    for (data_t d: reference)
-        std::cout << d.Vin << " -> " << d.Vout << std::endl;
-    std::cout << "---" << std::endl;
+    for (size_t i = 0; i < reference.size(); i++)
+        log << reference.getX()[i] + reference.getVmin() << " -> " << reference.getVout()[i] << std::endl;
+    log << "---" << std::endl;
 #endif
 
-    srand(time(0));
+    fit_options_t options;
+    options.config = config;
+    options.initial = haveParams ? params : InitialParameters(chip);
+    options.out = &std::cout;
+    options.listing = !config.quiet && config.output == Output_t::HUMAN;
+    options.cancel = &interrupted;
+    const fit_result_t result = Fit(reference, options);
+    if (!result.ok)
+    {
+        std::cout << "Error: " << result.error << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    const Parameters &fitted = result.params;
 
-    Optimize(reference, chip);
+    if (sensitivity || replicates)
+    {
+        const unsigned int workers = config.threads ? config.threads : std::max(1u, std::thread::hardware_concurrency());
+        AnalyzeFit(reference, fitted, replicates, level, config.seed ? config.seed : getSeed(), workers, log);
+    }
+
+    if (!lutFile.empty())
+    {
+        ExportLut(reference, fitted, lutFile, lutBits, chip, log);
+    }
+
+    if (!splineFile.empty())
+    {
+        ExportSpline(reference, fitted, splineFile, splineError, chip, log);
+    }
 }
@@ -0,0 +1,1160 @@
+/*
+ * This file is part of libsidplayfp, a SID player engine.
+ *
+ * Copyright 2023 Leandro Nini <drfiemost@users.sourceforge.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include <cmath>
+#include <cstdint>
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <array>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <algorithm>
+#include <functional>
+#include <mutex>
+
+#ifdef _OPENMP
+#  include <omp.h>
+#endif
+
+#include "parameters.h"
+#include "reference.h"
+#include "sharedbest.h"
+#include "random.h"
+#include "strategy.h"
+#include "reporter.h"
+
+static const double EPSILON = 1e-6;
+
+// margin of the single precision screen, relative to the score of the base;
+// the float scores of neighbouring candidates track the double ones
+// within a few 1e-6 on the built-in tables
+static const double FLOAT_TOLERANCE = 1e-5;
+
+// generations over which the pass rate of the screen is measured,
+// the screen is bypassed for SCREEN_BYPASS generations if more than
+// SCREEN_MAX_PASS of the candidates got through, as a float score costs
+// about half a double one
+static const uint64_t SCREEN_WINDOW = 256;
+static const uint64_t SCREEN_BYPASS = 16 * SCREEN_WINDOW;
+static const double SCREEN_MAX_PASS = 0.5;
+
+// Command line options
+struct config_t
+{
+    // candidates scored per generation
+    unsigned int proposals = 1;
+    // screen the candidates in single precision, see chain_t::screen()
+    bool screen = false;
+    // score the candidates which only change v from the cached
+    // softplus of the base, see chain_t::score()
+    bool incremental = true;
+    // Levenberg-Marquardt refinement of the starting point
+    bool refine = true;
+    // run the Monte Carlo search
+    bool search = true;
+    // grid sweep of about sweep points before the search, see DeviceSweep(),
+    // spanning a factor e^sweepSpan around the starting point, and how many
+    // of the best points are refined and kept as starting points
+    uint64_t sweep = 0;
+    double sweepSpan = 1.;
+    unsigned int sweepTop = 8;
+    // coarse-to-fine sweep over the bounds for the starting point, see GlobalSweep():
+    // bounds of log(q), b and v, levels of refinement, points per level,
+    // Latin hypercube samples instead of a grid and the cache directory
+    bool globalSweep = false;
+    double bounds[6] = { -1200., 0., 0.5, 500., 0.2, 5. };
+    unsigned int sweepLevels = 4;
+    uint64_t sweepPoints = 1 << 15;
+    bool lhs = false;
+    std::string sweepCache;
+    // fitted function, the starting point is converted to it
+    Transfer_t transfer = Transfer_t::LOGISTIC;
+    // objective: error metric, threshold of the Huber loss and
+    // input ranges with raised weights, see Reference::setMetric()
+    Metric_t metric = Metric_t::L2;
+    double huber = 0.05;
+    std::vector<region_t> regions;
+    // search over log(q) and log(b)
+    bool logq = false;
+    bool logb = false;
+    // stop criteria, zero means unlimited
+    uint64_t maxTrials = 0;
+    double maxTime = 0.;
+    uint64_t stagnation = 0;
+    // minimum relative gain for an improvement to reset the stagnation counter
+    double minGain = 0.;
+    // seconds between status lines, zero to disable
+    double status = 0.;
+    // worker threads, zero for the OpenMP default
+    unsigned int threads = 0;
+    // PRNG seed, zero for a random one
+    uint64_t seed = 0;
+    // don't report improvements
+    bool quiet = false;
+    // progress output format
+    Output_t output = Output_t::HUMAN;
+    // mutation strategy
+    Strategy_t strategy = Strategy_t::FIXED;
+    // reproducible search, see DeterministicSearch()
+    bool deterministic = false;
+    unsigned int lanes = 16;
+    // checkpoint file, seconds between checkpoints and resume from it
+    std::string checkpoint;
+    double checkpointInterval = 60.;
+    bool resume = false;
+    // independent chains and trials between migrations
+    unsigned int islands = 1;
+    uint64_t migrate = 1 << 20;
+};
+
+// Best of each chain in the island model
+typedef std::vector<std::unique_ptr<SharedBest>> islands_t;
+
+enum class Stop_t
+{
+    NONE,
+    SOLVED,
+    TRIALS,
+    TIME,
+    STAGNATION,
+    INTERRUPTED
+};
+
+inline const char* toString(Stop_t reason)
+{
+    switch (reason)
+    {
+    case Stop_t::SOLVED: return "exact fit found";
+    case Stop_t::TRIALS: return "trial budget exhausted";
+    case Stop_t::TIME: return "time budget exhausted";
+    case Stop_t::STAGNATION: return "no significant improvement";
+    case Stop_t::INTERRUPTED: return "interrupted";
+    default: return "none";
+    }
+}
+
+/**
+ * Published copy of a thread's statistics.
+ *
+ * Only the owner thread writes it, with plain relaxed stores of
+ * its private counters, so reading it from another thread never
+ * needs a read-modify-write on the hot path.
+ */
+struct alignas(64) counters_t
+{
+    std::atomic<uint64_t> trials;
+    std::atomic<uint64_t> improvements;
+    std::atomic<uint64_t> entropy;
+    std::atomic<uint64_t> sampledScores;
+    std::atomic<uint64_t> sampledNs;
+
+    counters_t() :
+        trials(0),
+        improvements(0),
+        entropy(0),
+        sampledScores(0),
+        sampledNs(0)
+    {}
+
+    void publish(const stats_t &stats)
+    {
+        trials.store(stats.trials, std::memory_order_relaxed);
+        improvements.store(stats.improvements, std::memory_order_relaxed);
+        entropy.store(stats.entropy, std::memory_order_relaxed);
+        sampledScores.store(stats.sampledScores, std::memory_order_relaxed);
+        sampledNs.store(stats.sampledNs, std::memory_order_relaxed);
+    }
+
+    void accumulate(stats_t &stats) const
+    {
+        stats.trials += trials.load(std::memory_order_relaxed);
+        stats.improvements += improvements.load(std::memory_order_relaxed);
+        stats.entropy += entropy.load(std::memory_order_relaxed);
+        stats.sampledScores += sampledScores.load(std::memory_order_relaxed);
+        stats.sampledNs += sampledNs.load(std::memory_order_relaxed);
+    }
+};
+
+// trials between checks of the stop criteria
+static const uint64_t CHECK_INTERVAL = 1024;
+
+// generations between timed calls of the scoring functions
+static const uint64_t SAMPLE_INTERVAL = 64;
+
+/**
+ * Widely scattered starting point for an island,
+ * each shape parameter is scaled by a factor roughly in [0.2, 1.8],
+ * asymptotes and weights are kept.
+ */
+inline Parameters IslandSeed(Rng &rng, const Parameters &base)
+{
+    Parameters p = base;
+    for (int i = 0; i < p.size(); i++)
+    {
+        if (p.role(i) != Param_t::A)
+            p.Scale(i, std::max(2. * GetNewRandomValue(rng), 0.1));
+    }
+    return p;
+}
+
+/**
+ * Ring migration: each island adopts the best of the previous one
+ * if it scores better than its own.
+ * All the bests are read first so that a single migration
+ * moves a candidate by one island only.
+ */
+inline void Migrate(islands_t &islands)
+{
+    const size_t M = islands.size();
+    std::vector<Parameters> params(M);
+    std::vector<score_t> scores(M);
+    for (size_t i = 0; i < M; i++)
+        islands[i]->read(params[i], scores[i]);
+    for (size_t i = 0; i < M; i++)
+    {
+        const size_t from = (i + M - 1) % M;
+        islands[i]->publish(params[from], scores[from], false);
+    }
+}
+
+/**
+ * Pick the parameters to change, each with 50% probability
+ * and at least one, using the bits of a single draw.
+ *
+ * @return bit i set for parameter i
+ */
+inline unsigned int SelectParameters(Rng &rng, int n)
+{
+    for (;;)
+    {
+        const unsigned int mask = GetRandomBits(rng) & ((1u << n) - 1);
+        if (mask)
+            return mask;
+    }
+}
+
+/**
+ * Randomly alter the base parameters with relative steps sigma,
+ * looping until at least one parameter has changed.
+ *
+ * Parameters selected for log space search get absolute steps sigma
+ * on their logarithm instead, a multiplicative step of the value whose
+ * size doesn't depend on how far the value is from 1.
+ * Asymptotes and weights, which can be zero, get absolute steps.
+ *
+ * @return the parameters that have been changed, bit i for parameter i
+ */
+inline unsigned int Mutate(Rng &rng, const config_t &config, const Parameters &base, Parameters &p, const double* sigma)
+{
+    p = base;
+
+    const int n = base.size();
+    unsigned int changed = 0;
+    while (!changed)
+    {
+        const unsigned int mask = SelectParameters(rng, n);
+        for (int i = 0; i < n; i++)
+        {
+            const unsigned int bit = 1u << i;
+            if (mask & bit)
+            {
+                const Param_t role = base.role(i);
+                if (role == Param_t::A)
+                {
+                    p.theta[i] = base.theta[i] + sigma[i] * GetGaussian(rng);
+                    if (p.theta[i] != base.theta[i])
+                        changed |= bit;
+                    continue;
+                }
+
+                const double step = sigma[i] * GetGaussian(rng);
+                const double factor = 1. + step;
+
+                const bool logspace = (role == Param_t::Q && config.logq) || (role == Param_t::B && config.logb);
+                if (logspace)
+                {
+                    const double oldValue = base.GetLogValue(i);
+                    const double newValue = oldValue + step;
+                    p.SetLogValue(i, newValue);
+                    if (oldValue != newValue)
+                        changed |= bit;
+                    continue;
+                }
+
+                //double newValue = oldValue + GetRandomValue();
+
+                // avoid negative values
+                if (factor <= 0.f)
+                {
+                    p.SetValue(i, EPSILON);
+                }
+                // try to avoid too small values
+                /*else if (newValue < EPSILON)
+                    newValue += GetNewRandomValue();*/
+                else
+                {
+                    p.Scale(i, factor);
+                }
+
+                if (factor != 1.)
+                    changed |= bit;
+            }
+        }
+    }
+    return changed;
+}
+
+/**
+ * Mutation and scoring state of a chain.
+ */
+struct chain_t
+{
+    // random stream of the chain
+    Rng rng;
+
+    std::vector<Parameters> candidates;
+    std::vector<score_t> scores;
+
+    // strategy state
+    StepAdaptation steps;
+    Cmaes cmaes;
+    std::vector<unsigned int> masks;
+    std::vector<std::array<double, MAX_PARAMS>> cmaesSteps;
+
+    // base of the single precision screen and its float score
+    Parameters screenBase;
+    double screenScore;
+    // candidates which passed it and their index
+    std::vector<Parameters> verify;
+    std::vector<score_t> verifyScores;
+    std::vector<size_t> verifyIndex;
+    // candidates screened and passed in the current window,
+    // generations left with the screen bypassed
+    uint64_t screened;
+    uint64_t passed;
+    uint64_t bypass;
+
+    // per sample softplus(b*x + log(q)) of a logistic base,
+    // with the q and b it was computed for
+    aligned_vector_t softplus;
+    double softplusQ;
+    double softplusB;
+    // scratch of scoreBatch(), the candidates which only change v
+    // and the others with their index
+    std::vector<Parameters> vonly;
+    std::vector<score_t> vonlyScores;
+    std::vector<size_t> vonlyIndex;
+    std::vector<Parameters> full;
+    std::vector<score_t> fullScores;
+    std::vector<size_t> fullIndex;
+
+    uint64_t generation;
+
+    // K candidates of n parameters
+    chain_t(size_t K, int n) :
+        rng(0),
+        candidates(K),
+        scores(K),
+        steps(n),
+        cmaes(n),
+        masks(K),
+        cmaesSteps(K),
+        screenScore(std::numeric_limits<double>::quiet_NaN()),
+        verify(K),
+        verifyScores(K),
+        verifyIndex(K),
+        screened(0),
+        passed(0),
+        bypass(0),
+        softplusQ(std::numeric_limits<double>::quiet_NaN()),
+        softplusB(std::numeric_limits<double>::quiet_NaN()),
+        vonly(K),
+        vonlyScores(K),
+        vonlyIndex(K),
+        full(K),
+        fullScores(K),
+        fullIndex(K),
+        generation(0)
+    {}
+
+    void save(std::ostream &os) const
+    {
+        rng.save(os);
+        os << " " << generation << " " << screened << " " << passed << " " << bypass << " ";
+        steps.save(os);
+        os << " ";
+        cmaes.save(os);
+    }
+
+    bool load(std::istream &is)
+    {
+        return rng.load(is) && static_cast<bool>(is >> generation >> screened >> passed >> bypass) && steps.load(is) && cmaes.load(is);
+    }
+
+    // a logistic candidate with the q and b of the base
+    static bool vOnly(const Parameters &base, const Parameters &p)
+    {
+        return p.transfer == Transfer_t::LOGISTIC
+            && p.theta[Logistic::Q] == base.theta[Logistic::Q]
+            && p.theta[Logistic::B] == base.theta[Logistic::B];
+    }
+
+    // softplus of the base, recomputed when its q or b has changed
+    const double* baseSoftplus(const Reference &reference, const Parameters &base)
+    {
+        if (softplusQ != base.theta[Logistic::Q] || softplusB != base.theta[Logistic::B])
+        {
+            softplus.resize(reference.paddedSize());
+            base.GetSoftplus(reference, softplus.data());
+            softplusQ = base.theta[Logistic::Q];
+            softplusB = base.theta[Logistic::B];
+        }
+        return softplus.data();
+    }
+
+    /**
+     * Full precision score of a candidate of the base.
+     *
+     * With config.incremental a logistic candidate which only
+     * changes v reuses the softplus of the base, recomputed once
+     * per base, which saves the log1p and one of the two exps
+     * per sample; the score is the same.
+     */
+    score_t score(const Reference &reference, const config_t &config, const Parameters &base, const Parameters &p, double bestscore)
+    {
+        if (config.incremental && vOnly(base, p))
+            return p.ScoreSoftplus(reference, baseSoftplus(reference, base), bestscore);
+        return p.Score(reference, nullptr, bestscore);
+    }
+
+    // same for a batch, ScoreBatch() of the ones which can't be scored incrementally
+    void scoreBatch(const Reference &reference, const config_t &config, const Parameters &base,
+        const Parameters* params, score_t* out, size_t K, double bestscore)
+    {
+        size_t V = 0;
+        size_t F = 0;
+        for (size_t k = 0; k < K; k++)
+        {
+            if (config.incremental && vOnly(base, params[k]))
+            {
+                vonly[V] = params[k];
+                vonlyIndex[V++] = k;
+            }
+            else
+            {
+                full[F] = params[k];
+                fullIndex[F++] = k;
+            }
+        }
+
+        if (V == 0)
+        {
+            ScoreBatch(reference, params, out, K, bestscore);
+            return;
+        }
+
+        ScoreBatchSoftplus(reference, baseSoftplus(reference, base), vonly.data(), vonlyScores.data(), V, bestscore);
+        for (size_t j = 0; j < V; j++)
+            out[vonlyIndex[j]] = vonlyScores[j];
+        if (F > 0)
+        {
+            ScoreBatch(reference, full.data(), fullScores.data(), F, bestscore);
+            for (size_t j = 0; j < F; j++)
+                out[fullIndex[j]] = fullScores[j];
+        }
+    }
+
+    /**
+     * Score the candidates in single precision first and only
+     * the ones which may be as good as the base again in double.
+     *
+     * The float scores are compared with the float score of the base,
+     * which takes most of the rounding error out, and the candidates
+     * outside of the tolerance get an infinite score so they are never
+     * taken; anything accepted has a full precision score, the same
+     * it would get without the screen.
+     * The screen pays off while the steps are large enough to move
+     * the score by more than the tolerance, close to convergence
+     * most candidates pass and would be scored twice, so there
+     * the screen is switched off from time to time.
+     */
+    void screen(const Reference &reference, const config_t &config, const Parameters &base, const score_t &basescore)
+    {
+        const size_t K = candidates.size();
+
+        if (std::isnan(screenScore) || screenBase != base)
+        {
+            screenBase = base;
+            screenScore = base.ScoreFloat(reference, std::numeric_limits<double>::infinity()).error;
+        }
+        const double threshold = screenScore * (1. + FLOAT_TOLERANCE);
+
+        size_t P = 0;
+        if (K == 1)
+        {
+            scores[0] = candidates[0].ScoreFloat(reference, threshold);
+            if (scores[0].error <= threshold)
+            {
+                scores[0] = score(reference, config, base, candidates[0], basescore.error);
+                P++;
+            }
+            else
+            {
+                scores[0].error = std::numeric_limits<double>::infinity();
+            }
+        }
+        else
+        {
+            ScoreBatchFloat(reference, candidates.data(), scores.data(), K, threshold);
+            for (size_t k = 0; k < K; k++)
+            {
+                if (scores[k].error <= threshold)
+                {
+                    verify[P] = candidates[k];
+                    verifyIndex[P++] = k;
+                }
+                scores[k].error = std::numeric_limits<double>::infinity();
+            }
+            if (P > 0)
+            {
+                scoreBatch(reference, config, base, verify.data(), verifyScores.data(), P, basescore.error);
+                for (size_t j = 0; j < P; j++)
+                    scores[verifyIndex[j]] = verifyScores[j];
+            }
+        }
+
+        passed += P;
+        screened += K;
+        if (screened >= SCREEN_WINDOW * K)
+        {
+            if (passed > SCREEN_MAX_PASS * screened)
+                bypass = SCREEN_BYPASS;
+            screened = 0;
+            passed = 0;
+        }
+    }
+
+    /**
+     * Run one generation: mutate the base into the candidates,
+     * score them and adapt the strategy.
+     *
+     * With more than one proposal per generation the candidates are
+     * scored together with scoreBatch() and only the best one is kept,
+     * with config.screen they go through screen() instead.
+     *
+     * @return the index of the best candidate, its score in scores[0]
+     * when there is a single proposal
+     */
+    size_t step(const Reference &reference, const config_t &config, const Parameters &base, const score_t &basescore, stats_t &stats)
+    {
+        const size_t K = candidates.size();
+
+        for (size_t k = 0; k < K; k++)
+        {
+            if (config.strategy == Strategy_t::CMAES)
+                cmaes.sample(rng, base, candidates[k], cmaesSteps[k]);
+            else
+                masks[k] = Mutate(rng, config, base, candidates[k], steps.sigma());
+        }
+
+        const bool timed = (generation++ % SAMPLE_INTERVAL) == 0;
+        const auto t0 = timed ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+
+        // the float screen only knows the squared error
+        const bool screening = config.screen && bypass == 0 && reference.getMetric() == Metric_t::L2;
+        if (config.screen && bypass > 0)
+            bypass--;
+
+        if (screening)
+            screen(reference, config, base, basescore);
+        else if (K == 1)
+            scores[0] = score(reference, config, base, candidates[0], basescore.error);
+        else
+            scoreBatch(reference, config, base, candidates.data(), scores.data(), K, basescore.error);
+
+        size_t best = 0;
+        for (size_t k = 1; k < K; k++)
+        {
+            if (scores[best].isBetter(scores[k]))
+                best = k;
+        }
+
+        if (timed)
+        {
+            stats.sampledNs += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+            stats.sampledScores += K;
+        }
+
+        stats.trials += K;
+
+        // equal scores are accepted as well
+        const bool success = scores[best].error <= basescore.error;
+        if (config.strategy == Strategy_t::ADAPTIVE)
+        {
+            for (size_t k = 0; k < K; k++)
+                steps.update(masks[k], success && k == best);
+        }
+        else if (config.strategy == Strategy_t::CMAES)
+        {
+            cmaes.update(success, cmaesSteps[best]);
+        }
+
+        return best;
+    }
+};
+
+// equal score moves are only worth taking if the parameters did change,
+// steps below the resolution of a double give back the base itself
+inline bool IsEntropyMove(const Parameters &p, const score_t &score, const Parameters &base, const score_t &basescore)
+{
+    return score.error == basescore.error && p != base;
+}
+
+// Chain of the deterministic search
+struct lane_t
+{
+    chain_t chain;
+    Parameters best;
+    score_t score;
+    stats_t stats;
+
+    lane_t(size_t K, int n) : chain(K, n) {}
+
+    // only the generator and the strategy carry over between epochs
+    void save(std::ostream &os) const { chain.save(os); }
+    bool load(std::istream &is) { return chain.load(is); }
+};
+
+/**
+ * Generator and strategy state of a worker of the free running search,
+ * as text in the lane format, published for the checkpoints.
+ */
+struct alignas(64) worker_state_t
+{
+    mutable std::mutex mutex;
+    // empty until the worker has published
+    std::string state;
+
+    void publish(const chain_t &chain)
+    {
+        std::ostringstream os;
+        os.precision(std::numeric_limits<double>::max_digits10);
+        chain.save(os);
+        std::lock_guard<std::mutex> lock(mutex);
+        state = os.str();
+    }
+
+    // restore the chain, false if there is nothing to restore
+    bool restore(chain_t &chain)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::istringstream is(state);
+        return !state.empty() && chain.load(is);
+    }
+
+    std::string get() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return state;
+    }
+
+    void set(const std::string &s)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        state = s;
+    }
+};
+
+/**
+ * Runs f(0) ... f(n-1) concurrently and returns when all of them
+ * have returned, e.g. on the threads of a pool of the caller.
+ */
+typedef std::function<void(unsigned int n, const std::function<void(unsigned int)> &f)> executor_t;
+
+// Run state shared by the worker threads
+struct run_t
+{
+    std::chrono::steady_clock::time_point start;
+    std::atomic<bool> done;
+    std::atomic<Stop_t> reason;
+    // total trials, updated in chunks by the workers
+    std::atomic<uint64_t> trials;
+    // trial count at the last significant improvement
+    std::atomic<uint64_t> lastImprovement;
+    // trial count of the next migration between islands
+    std::atomic<uint64_t> nextMigration;
+    // one slot per thread
+    std::vector<counters_t> counters;
+    // statistics of the sessions before a resume
+    stats_t resumed;
+    // lanes of the deterministic search, kept for the checkpoints
+    std::vector<lane_t> lanes;
+    // same for the free running workers, one slot per thread,
+    // published every checkpoint interval and when they stop
+    std::vector<worker_state_t> workers;
+    // called every checkpointInterval seconds, by one thread at a time
+    std::function<void(const run_t&)> checkpoint;
+    double checkpointInterval;
+    // progress output, none if null
+    Reporter* reporter;
+    // stops the search gracefully when set, e.g. from a signal handler
+    const std::atomic<bool>* cancel;
+    // runs the worker threads instead of OpenMP if set
+    executor_t executor;
+
+    run_t(unsigned int threads) :
+        start(std::chrono::steady_clock::now()),
+        done(false),
+        reason(Stop_t::NONE),
+        trials(0),
+        lastImprovement(0),
+        nextMigration(0),
+        counters(threads),
+        workers(threads),
+        checkpointInterval(0.),
+        reporter(nullptr),
+        cancel(nullptr)
+    {}
+
+    stats_t total() const
+    {
+        stats_t stats = resumed;
+        for (const counters_t &c: counters)
+            c.accumulate(stats);
+        return stats;
+    }
+
+    double elapsed() const
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    void stop(Stop_t why)
+    {
+        // keep the first reason
+        Stop_t expected = Stop_t::NONE;
+        reason.compare_exchange_strong(expected, why);
+        done = true;
+    }
+};
+
+
+inline report_t ImprovementReport(run_t &run, const score_t &score, const Parameters &p, unsigned int islands, unsigned int island, uint64_t trials)
+{
+    report_t r;
+    r.kind = Report_t::IMPROVEMENT;
+    r.index = island;
+    r.total = islands;
+    r.count = trials;
+    r.time = run.elapsed();
+    r.setParameters(p, score);
+    return r;
+}
+
+inline report_t StatusReport(run_t &run)
+{
+    report_t r;
+    r.kind = Report_t::STATUS;
+    r.stats = run.total();
+    r.time = run.elapsed();
+    return r;
+}
+
+inline void CheckStop(const config_t &config, run_t &run, uint64_t total)
+{
+    // the improvement may be counted with trials of its thread
+    // which are not in this total yet
+    const uint64_t last = run.lastImprovement.load(std::memory_order_relaxed);
+    if (run.cancel && run.cancel->load(std::memory_order_relaxed))
+        run.stop(Stop_t::INTERRUPTED);
+    else if (config.maxTrials && total >= config.maxTrials)
+        run.stop(Stop_t::TRIALS);
+    else if (config.maxTime > 0. && run.elapsed() >= config.maxTime)
+        run.stop(Stop_t::TIME);
+    else if (config.stagnation && total > last && total - last >= config.stagnation)
+        run.stop(Stop_t::STAGNATION);
+}
+
+/**
+ * Monte Carlo worker: we randomly alter the shared best parameters
+ * and calculate the new score until we find the best fitting
+ * function compared to the sampled data.
+ * Each thread has its own chain, PRNG included, and only touches
+ * the shared state when it finds something worth publishing.
+ *
+ * In the island model thread t works on island t mod M; if there are
+ * more islands than threads each thread moves on to its next island
+ * at every check, so that all of them make progress.
+ */
+inline void Worker(const Reference &reference, const config_t &config, islands_t &islands, run_t &run, unsigned int thread)
+{
+    const unsigned int threads = run.counters.size();
+    const unsigned int M = islands.size();
+    unsigned int island = thread % M;
+    SharedBest* shared = islands[island].get();
+
+    Parameters bestparams;
+    score_t bestscore;
+    unsigned int version = shared->read(bestparams, bestscore);
+
+    chain_t chain(config.proposals, TransferSize(config.transfer));
+
+    // the costlier functions check the stop criteria every fewer trials
+    const uint64_t checkInterval = std::max<uint64_t>(1, static_cast<uint64_t>(CHECK_INTERVAL / TransferCost(config.transfer)));
+
+    // no denormals in the scoring loop
+    const simd::FlushDenormals ftz;
+
+    // a resumed run carries on with the generator and strategy the
+    // thread had, new threads offset their stream by the trials so
+    // that they don't replay the ones of the first session
+    if (!run.workers[thread].restore(chain))
+    {
+        if (config.seed)
+            chain.rng.seed(config.seed + run.trials.load(), thread + 1);
+        else
+            chain.rng.seed(getSeed(), 0);
+    }
+
+    // trials not yet added to the shared counter
+    uint64_t trials = 0;
+
+    stats_t stats;
+    double nextStatus = config.status;
+    double nextCheckpoint = run.elapsed() + run.checkpointInterval;
+
+    while (!run.done.load(std::memory_order_relaxed))
+    {
+        if (trials >= checkInterval)
+        {
+            const uint64_t total = run.trials.fetch_add(trials, std::memory_order_relaxed) + trials;
+            trials = 0;
+
+            run.counters[thread].publish(stats);
+
+            if (thread == 0 && config.status > 0. && run.elapsed() >= nextStatus)
+            {
+                if (run.reporter)
+                    run.reporter->post(StatusReport(run));
+                nextStatus += config.status;
+            }
+
+            if (run.checkpoint && run.elapsed() >= nextCheckpoint)
+            {
+                run.workers[thread].publish(chain);
+                if (thread == 0)
+                    run.checkpoint(run);
+                nextCheckpoint = run.elapsed() + run.checkpointInterval;
+            }
+
+            CheckStop(config, run, total);
+
+            if (run.done.load(std::memory_order_relaxed))
+                break;
+
+            if (M > 1)
+            {
+                // whoever gets the slot does the migration
+                uint64_t next = run.nextMigration.load(std::memory_order_relaxed);
+                if (total >= next && run.nextMigration.compare_exchange_strong(next, next + config.migrate, std::memory_order_relaxed))
+                    Migrate(islands);
+
+                if (M > threads)
+                {
+                    island = (island + threads) % M;
+                    shared = islands[island].get();
+                    version = shared->read(bestparams, bestscore);
+                }
+            }
+        }
+
+        // pick up improvements from the other threads
+        if (shared->version() != version)
+        {
+            version = shared->read(bestparams, bestscore);
+        }
+
+        const size_t best = chain.step(reference, config, bestparams, bestscore, stats);
+        const Parameters &p = chain.candidates[best];
+        const score_t score = chain.scores[best];
+        trials += chain.candidates.size();
+
+        // check new score
+        if (bestscore.isBetter(score))
+        {
+            // accept if improvement
+            if (shared->publish(p, score, false))
+            {
+                stats.improvements++;
+                const uint64_t now = run.trials.load(std::memory_order_relaxed) + trials;
+                if (bestscore.error - score.error >= config.minGain * bestscore.error)
+                    run.lastImprovement.store(now, std::memory_order_relaxed);
+
+                // skip the report if someone else has already done better
+                Parameters current;
+                score_t currentscore;
+                shared->read(current, currentscore);
+                if (!config.quiet && run.reporter && currentscore.error == score.error)
+                    run.reporter->post(ImprovementReport(run, score, p, M, island, now));
+                if (score.error == 0)
+                    run.stop(Stop_t::SOLVED);
+            }
+            //p.reset();
+            version = shared->read(bestparams, bestscore);
+        }
+        else if (IsEntropyMove(p, score, bestparams, bestscore))
+        {
+            // no improvement but use new parameters as base to increase the "entropy"
+            if (shared->publish(p, score, true))
+            {
+                stats.entropy++;
+                version = shared->read(bestparams, bestscore);
+            }
+        }
+    }
+
+    run.trials.fetch_add(trials, std::memory_order_relaxed);
+    run.counters[thread].publish(stats);
+    if (run.checkpoint)
+        run.workers[thread].publish(chain);
+}
+
+/**
+ * Deterministic search: the work is split into a fixed number of lanes,
+ * independent from the number of threads, which run in lockstep epochs.
+ *
+ * In each epoch every lane runs CHECK_INTERVAL trials from the
+ * island bests, with its own random stream and strategy state,
+ * then the lane results are merged in lane order. Lane k belongs to
+ * island k mod M and uses stream k+1 of the seed.
+ * Stop criteria and migrations are only evaluated between epochs,
+ * so with the same seed the result only depends on the trial count
+ * and not on how the lanes are spread over the threads.
+ * The time budget is the only exception.
+ */
+inline void DeterministicSearch(const Reference &reference, const config_t &config, islands_t &islands, run_t &run)
+{
+    const unsigned int threads = run.counters.size();
+    const unsigned int M = islands.size();
+    const unsigned int L = std::max(config.lanes, M);
+
+    // the lanes are already there when resuming
+    std::vector<lane_t> &lanes = run.lanes;
+    if (lanes.empty())
+    {
+        lanes.reserve(L);
+        for (unsigned int k = 0; k < L; k++)
+        {
+            lanes.emplace_back(config.proposals, TransferSize(config.transfer));
+            lanes[k].chain.rng.seed(config.seed, k + 1);
+        }
+    }
+
+    std::vector<stats_t> stats(threads);
+    std::vector<Parameters> base(M);
+    std::vector<score_t> basescore(M);
+    double nextStatus = config.status;
+    double nextCheckpoint = run.elapsed() + run.checkpointInterval;
+
+    while (!run.done)
+    {
+        for (unsigned int i = 0; i < M; i++)
+            islands[i]->read(base[i], basescore[i]);
+
+        // one epoch of lane k, on the thread with slot s
+        auto epoch = [&](unsigned int k, stats_t &s) {
+            lane_t &lane = lanes[k];
+            const simd::FlushDenormals ftz;
+
+            lane.best = base[k % M];
+            lane.score = basescore[k % M];
+            lane.stats = stats_t();
+            for (uint64_t trials = 0; trials < CHECK_INTERVAL; trials += lane.chain.candidates.size())
+            {
+                const size_t best = lane.chain.step(reference, config, lane.best, lane.score, lane.stats);
+                const Parameters &p = lane.chain.candidates[best];
+                const score_t score = lane.chain.scores[best];
+                if (lane.score.isBetter(score))
+                {
+                    lane.best = p;
+                    lane.score = score;
+                    lane.stats.improvements++;
+                }
+                else if (IsEntropyMove(p, score, lane.best, lane.score))
+                {
+                    lane.best = p;
+                    lane.stats.entropy++;
+                }
+            }
+
+            s.trials += lane.stats.trials;
+            s.improvements += lane.stats.improvements;
+            s.entropy += lane.stats.entropy;
+            s.sampledNs += lane.stats.sampledNs;
+            s.sampledScores += lane.stats.sampledScores;
+        };
+
+        if (run.executor)
+        {
+            run.executor(threads, [&](unsigned int t) {
+                for (unsigned int k = t; k < L; k += threads)
+                    epoch(k, stats[t]);
+            });
+        }
+        else
+        {
+#ifdef _OPENMP
+#   pragma omp parallel for schedule(static) num_threads(threads)
+            for (int k = 0; k < static_cast<int>(L); k++)
+                epoch(k, stats[omp_get_thread_num()]);
+#else
+            for (unsigned int k = 0; k < L; k++)
+                epoch(k, stats[0]);
+#endif
+        }
+
+        uint64_t total = run.trials;
+        for (const lane_t &lane: lanes)
+            total += lane.stats.trials;
+        run.trials = total;
+        for (unsigned int t = 0; t < threads; t++)
+            run.counters[t].publish(stats[t]);
+
+        // merge, the first lane wins ties
+        for (unsigned int i = 0; i < M; i++)
+        {
+            const lane_t* best = nullptr;
+            for (unsigned int k = i; k < L; k += M)
+            {
+                if (!best || best->score.isBetter(lanes[k].score))
+                    best = &lanes[k];
+            }
+
+            if (basescore[i].isBetter(best->score))
+            {
+                islands[i]->publish(best->best, best->score, false);
+                if (basescore[i].error - best->score.error >= config.minGain * basescore[i].error)
+                    run.lastImprovement = total;
+                if (!config.quiet && run.reporter)
+                    run.reporter->send(ImprovementReport(run, best->score, best->best, M, i, total));
+                if (best->score.error == 0)
+                    run.stop(Stop_t::SOLVED);
+            }
+            else if (IsEntropyMove(best->best, best->score, base[i], basescore[i]))
+            {
+                islands[i]->publish(best->best, best->score, true);
+            }
+        }
+
+        if (config.status > 0. && run.elapsed() >= nextStatus)
+        {
+            if (run.reporter)
+                run.reporter->send(StatusReport(run));
+            nextStatus += config.status;
+        }
+
+        CheckStop(config, run, total);
+
+        if (M > 1 && total >= run.nextMigration)
+        {
+            Migrate(islands);
+            run.nextMigration = run.nextMigration + config.migrate;
+        }
+
+        // at the end of the epoch, so a resumed run starts with the next one
+        if (run.checkpoint && run.elapsed() >= nextCheckpoint)
+        {
+            run.checkpoint(run);
+            nextCheckpoint = run.elapsed() + run.checkpointInterval;
+        }
+    }
+}
+
+/**
+ * Number of worker threads the search will use.
+ */
+inline unsigned int SearchThreads([[maybe_unused]] const config_t &config)
+{
+#ifdef _OPENMP
+    return config.threads ? config.threads : omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+/**
+ * Run the Monte Carlo search on all the worker threads,
+ * the ones of the run's executor or else OpenMP's,
+ * until one of the stop criteria is met.
+ */
+inline void Search(const Reference &reference, const config_t &config, islands_t &islands, run_t &run)
+{
+    // a resumed run carries on with its own schedule
+    if (run.trials == 0)
+        run.nextMigration = config.migrate;
+    if (config.deterministic)
+    {
+        DeterministicSearch(reference, config, islands, run);
+        return;
+    }
+    if (run.executor)
+    {
+        run.executor(run.counters.size(), [&](unsigned int t) { Worker(reference, config, islands, run, t); });
+        return;
+    }
+#ifdef _OPENMP
+#   pragma omp parallel num_threads(run.counters.size())
+    Worker(reference, config, islands, run, omp_get_thread_num());
+#else
+    Worker(reference, config, islands, run, 0);
+#endif
+}
+
+/**
+ * Index of the island holding the overall best.
+ */
+inline size_t BestIsland(const islands_t &islands, Parameters &params, score_t &score)
+{
+    size_t best = 0;
+    islands[0]->read(params, score);
+    for (size_t i = 1; i < islands.size(); i++)
+    {
+        Parameters p;
+        score_t s;
+        islands[i]->read(p, s);
+        if (score.isBetter(s))
+        {
+            best = i;
+            params = p;
+            score = s;
+        }
+    }
+    return best;
+}
+
+#endif
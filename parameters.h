@@ -25,32 +25,15 @@
 
 #include <vector>
 #include <string>
+#include <ostream>
 #include <sstream>
 #include <iomanip>
 #include <limits>
+#include <algorithm>
 
-
-// Model parameters
-enum class Param_t
-{
-    Q,
-    B,
-    V
-};
-
-// define the postfix increment operator to allow looping over enum
-inline Param_t& operator++(Param_t& x, int)
-{
-    return x = static_cast<Param_t>(static_cast<std::underlying_type<Param_t>::type>(x) + 1);
-}
-
-typedef struct
-{
-    double Vin;
-    double Vout;
-} data_t;
-
-typedef std::vector<data_t> ref_vector_t;
+#include "simd.h"
+#include "reference.h"
+#include "transfer.h"
 
 struct score_t
 {
@@ -66,7 +49,7 @@ struct score_t
     }
 };
 
-std::ostream & operator<<(std::ostream & os, const score_t & foo)
+inline std::ostream & operator<<(std::ostream & os, const score_t & foo)
 {
    os.precision(std::numeric_limits<double>::max_digits10);
    os << foo.error;
@@ -76,99 +59,591 @@ std::ostream & operator<<(std::ostream & os, const score_t & foo)
 class Parameters
 {
 public:
-    double q, b, v;
+    Transfer_t transfer;
+
+    // q is kept as its logarithm, the fitted values can be way below
+    // the double range and would otherwise end up as denormals or zero;
+    // only the first size() values are used
+    double theta[MAX_PARAMS];
 
 public:
-    Parameters() { reset(); }
+    Parameters(Transfer_t t = Transfer_t::LOGISTIC) { reset(t); }
+
+    // flat curve, q = b = v = 1
+    void reset(Transfer_t t = Transfer_t::LOGISTIC)
+    {
+        static const double flat[Logistic::N] = { 0., 1., 1. };
+
+        transfer = t;
+        std::fill(theta, theta + MAX_PARAMS, 0.);
+        WithTransfer(t, [this](auto model) { decltype(model)::fromLogistic(flat, theta); });
+    }
+
+    /**
+     * Parameters of the transfer function t giving
+     * the same curve as the logistic ones.
+     */
+    static Parameters FromLogistic(const Parameters &logistic, Transfer_t t)
+    {
+        if (logistic.transfer == t)
+            return logistic;
+
+        Parameters p(t);
+        WithTransfer(t, [&](auto model) { decltype(model)::fromLogistic(logistic.theta, p.theta); });
+        return p;
+    }
+
+    int size() const { return TransferSize(transfer); }
+
+    Param_t role(int i) const
+    {
+        return WithTransfer(transfer, [i](auto model) { return decltype(model)::roles[i]; });
+    }
+
+    const char* name(int i) const
+    {
+        return WithTransfer(transfer, [i](auto model) { return decltype(model)::names[i]; });
+    }
+
+    bool operator==(const Parameters &other) const
+    {
+        return transfer == other.transfer && std::equal(theta, theta + size(), other.theta);
+    }
+
+    bool operator!=(const Parameters &other) const { return !(*this == other); }
+
+    double GetValue(int i) const
+    {
+        return role(i) == Param_t::Q ? std::exp(theta[i]) : theta[i];
+    }
 
-    void reset()
+    void SetValue(int i, double d)
     {
-        q = 1.;
-        b = 1.;
-        v = 1.;
+        theta[i] = role(i) == Param_t::Q ? std::log(d) : d;
     }
 
-    double GetValue(Param_t i)
+    // natural logarithm of the parameter, the value itself
+    // for the ones which can be zero or negative
+    double GetLogValue(int i) const
     {
-        switch (i)
+        switch (role(i))
         {
-            case Param_t::Q: return q;
-            case Param_t::B: return b;
-            case Param_t::V: return v;
-            default: return 0.; // Just to silence warning
+            case Param_t::Q:
+            case Param_t::A: return theta[i];
+            default: return std::log(theta[i]);
         }
     }
 
-    void SetValue(Param_t i, double d)
+    void SetLogValue(int i, double d)
     {
-        switch (i)
+        switch (role(i))
         {
-            case Param_t::Q: q = d; break;
-            case Param_t::B: b = d; break;
-            case Param_t::V: v = d; break;
+            case Param_t::Q:
+            case Param_t::A: theta[i] = d; break;
+            default: theta[i] = std::exp(d); break;
         }
     }
 
-    std::string toString()
+    // multiply the parameter by a positive factor
+    void Scale(int i, double f)
+    {
+        if (role(i) == Param_t::Q)
+            theta[i] += std::log(f);
+        else
+            theta[i] *= f;
+    }
+
+    std::string toString() const
     {
         std::ostringstream ss;
         ss.precision(std::numeric_limits<double>::max_digits10);
-        ss << "q = " << q << std::endl;
-        ss << "b = " << b << std::endl;
-        ss << "v = " << v << std::endl;
+        if (transfer != Transfer_t::LOGISTIC)
+            ss << "model = " << ::toString(transfer) << std::endl;
+        for (int i = 0; i < size(); i++)
+        {
+            if (role(i) != Param_t::Q)
+            {
+                ss << name(i) << " = " << theta[i] << std::endl;
+                continue;
+            }
+
+            // q parameters are named after their logarithm
+            const std::string label = std::string(name(i)).substr(3);
+            const double logq = theta[i];
+            const double q = std::exp(logq);
+            if (q >= std::numeric_limits<double>::min() || !std::isfinite(logq))
+            {
+                ss << label << " = " << q << std::endl;
+            }
+            else
+            {
+                // below the normal double range, print it from its logarithm
+                const double l10 = logq / std::log(10.);
+                const double e = std::floor(l10);
+                ss << label << " = " << std::pow(10., l10 - e) << "e" << e
+                   << " (log " << label << " = " << logq << ")" << std::endl;
+            }
+        }
         return ss.str();
     }
 
-private:
-    double GetValue(double Vin) const
+    /**
+     * Normalized output g(x) using libm, optionally returning
+     * its derivative with respect to x.
+     */
+    double GetNormalized(double x, double* derivative = nullptr) const
+    {
+        return WithTransfer(transfer, [&](auto model) { return decltype(model)::value(theta, x, derivative, nullptr); });
+    }
+
+    /**
+     * Normalized output g(x) and its gradient
+     * with respect to the size() parameters.
+     */
+    double GetGradient(double x, double* gradient) const
     {
-        // https://en.wikipedia.org/wiki/Generalised_logistic_function
-        // y = min + (max-min)/(1+Q*e^-B*x)^(1/v)
-        return std::pow(1. + q*std::exp(b*Vin), 1./v);
+        return WithTransfer(transfer, [&](auto model) { return decltype(model)::value(theta, x, nullptr, gradient); });
     }
 
-    double GetScore(double Vout, double Vref) const
+    // loop invariant constants of the kernel, broadcast
+    template<typename T>
+    void Prepare(simd::vdouble* c) const
     {
-        double diff = (Vout - Vref)/Vref;
+        double constants[T::C];
+        T::prepare(theta, constants);
+        for (int m = 0; m < T::C; m++)
+            c[m] = constants[m];
+    }
+
+    // same in single precision for inputs shifted by xc,
+    // the constants are computed in double and rounded once
+    template<typename T>
+    void PrepareFloat(simd::vfloat* c, double xc) const
+    {
+        double constants[T::C];
+        T::prepare(theta, constants, xc);
+        for (int m = 0; m < T::C; m++)
+            c[m] = static_cast<float>(constants[m]);
+    }
+
+private:
+    // relative error, weight is 1/Vref
+    double GetScore(double Vout, double Vref, double weight) const
+    {
+        double diff = (Vout - Vref)*weight;
         return diff * diff;
     }
 
-public:
-    score_t Score(const ref_vector_t &reference, bool print, unsigned int bestscore)
+    template<typename T>
+    void GetValues(const double* x, double* y, size_t n) const
+    {
+        const int W = simd::vdouble::width;
+        simd::vdouble c[T::C];
+        Prepare<T>(c);
+
+        size_t i = 0;
+        for (; i + W <= n; i += W)
+        {
+            T::kernel(simd::vdouble::loadu(x + i), c).storeu(y + i);
+        }
+        if (i < n)
+        {
+            // leftover values
+            alignas(64) double tmp[W] = {};
+            std::copy(x + i, x + n, tmp);
+            T::kernel(simd::vdouble::load(tmp), c).store(tmp);
+            std::copy(tmp, tmp + (n - i), y + i);
+        }
+    }
+
+    template<typename T, typename M>
+    score_t Score(const Reference &reference, std::ostream* listing, double bestscore, M error) const
     {
         score_t score;
 
-        const double Vmin = reference[0].Vin;
-        const double Vmax = reference[0].Vout;
+        const double Vmin = reference.getVmin();
+        const double Vmax = reference.getVmax();
+
+        const double* x = reference.getX();
+        const double* vout = reference.getVout();
+        const double* weight = reference.getWeight();
+
+        // compare in the units of the partial values, squared for
+        // the sums, to avoid a sqrt per sample
+        const double bound = M::bound(bestscore);
 
-        double error = 0.;
+        const int W = simd::vdouble::width;
+        simd::vdouble c[T::C];
+        Prepare<T>(c);
 
-        for (data_t data: reference)
+        const size_t n = reference.paddedSize();
+        for (size_t i = 0; i < n; i += W)
         {
             // Calculate score
-            const double simval = Vmin + (Vmax-Vmin)/GetValue(data.Vin-Vmin);
-            const double err = GetScore(simval, data.Vout);
-            error += err;
+            const simd::vdouble simval = simd::fma(T::kernel(simd::vdouble::load(x + i), c), Vmax-Vmin, Vmin);
+            error.add(GetResidual(simval, simd::vdouble::load(vout + i), simd::vdouble::load(weight + i)));
 
-            if (print)
+            if (listing)
             {
-                std::cout
-                          << simval << " "
-                          << data.Vout << " ("
-                          << err << ")"
-                          << std::endl;
+                alignas(64) double sim[W];
+                simval.store(sim);
+                for (size_t j = i; j < std::min(i + W, reference.size()); j++)
+                {
+                    *listing
+                              << sim[j-i] << " "
+                              << vout[j] << " ("
+                              << GetScore(sim[j-i], vout[j], weight[j]) << ")"
+                              << std::endl;
+                }
             }
+            else if (M::reduce(error.partial()) > bound)
+            {
+                break;
+            }
+        }
+
+        score.error = M::finish(M::reduce(error.total()));
+
+        if (listing)
+        {
+            *listing << "Error: " << score.error << std::endl;
         }
 
-        score.error = std::sqrt(error);
+        return score;
+    }
+
+    template<typename T>
+    score_t ScoreFloat(const Reference &reference, double bestscore) const
+    {
+        const float* x = reference.getXFloat();
+        const float* scale = reference.getScaleFloat();
+        const float* offset = reference.getOffsetFloat();
+
+        const float bound = static_cast<float>(bestscore * bestscore);
+
+        const int W = simd::vfloat::width;
+        simd::vfloat c[T::C];
+        PrepareFloat<T>(c, reference.getCenter());
 
-        if (print)
+        simd::vfloat error = 0.f;
+        float sum = 0.f;
+
+        const size_t n = reference.paddedFloatSize();
+        for (size_t i = 0; i < n; i += W)
         {
-            std::cout << "Error: " << score.error << std::endl;
+            const simd::vfloat diff = simd::fma(T::kernel(simd::vfloat::load(x + i), c), simd::vfloat::load(scale + i), simd::vfloat::load(offset + i));
+            error = simd::fma(diff, diff, error);
+
+            sum = simd::hsum(error);
+            if (sum > bound)
+                break;
         }
 
+        score_t score;
+        score.error = std::sqrt(static_cast<double>(sum));
+        return score;
+    }
+
+public:
+    // weighted residual, reduced by the metric
+    static simd::vdouble GetResidual(simd::vdouble Vout, simd::vdouble Vref, simd::vdouble weight)
+    {
+        return (Vout - Vref)*weight;
+    }
+
+    /**
+     * Evaluate the normalized transfer function for a batch of n input values.
+     */
+    void GetValues(const double* x, double* y, size_t n) const
+    {
+        WithTransfer(transfer, [&](auto model) { GetValues<decltype(model)>(x, y, n); });
+    }
+
+    /**
+     * Calculate the score against the reference data,
+     * listing the output and error of each sample if asked.
+     *
+     * The calculation is aborted as soon as the partial error exceeds
+     * the bestscore bound, since the candidate can't win anymore;
+     * in that case the returned score is only a lower bound of the real one.
+     */
+    score_t Score(const Reference &reference, std::ostream* listing, double bestscore) const
+    {
+        if (!listing && reference.getScoreKernel())
+            return reference.getScoreKernel()(*this, bestscore);
+
+        return WithTransfer(transfer, [&](auto model) {
+            return WithMetric(reference.getMetric(), reference.getDelta(), [&](auto metric) {
+                return Score<decltype(model)>(reference, listing, bestscore, metric);
+            });
+        });
+    }
+
+    /**
+     * Score() in single precision, twice as many lanes wide.
+     *
+     * The rounding errors are way above the differences between
+     * neighbouring candidates, the result is only good for screening:
+     * compared with the ScoreFloat() of the base it tells which
+     * candidates are worth an actual Score().
+     * It always computes the squared error, whatever the metric.
+     */
+    score_t ScoreFloat(const Reference &reference, double bestscore) const
+    {
+        return WithTransfer(transfer, [&](auto model) { return ScoreFloat<decltype(model)>(reference, bestscore); });
+    }
+
+    /**
+     * softplus(b*x + log(q)) of a logistic for each of the padded
+     * samples, the part of the kernel which doesn't depend on v.
+     */
+    void GetSoftplus(const Reference &reference, double* s) const
+    {
+        const int W = simd::vdouble::width;
+        simd::vdouble c[Logistic::C];
+        Prepare<Logistic>(c);
+
+        const double* x = reference.getX();
+        for (size_t i = 0; i < reference.paddedSize(); i += W)
+            simd::softplus(simd::fma(simd::vdouble::load(x + i), c[0], c[1])).store(s + i);
+    }
+
+    /**
+     * Score() of a logistic from the GetSoftplus() of parameters
+     * with the same q and b, which leaves a multiply and an exp
+     * per sample. Same operations in the same order as the full
+     * kernel, so the score is the same as well.
+     */
+    score_t ScoreSoftplus(const Reference &reference, const double* s, double bestscore) const
+    {
+        return WithMetric(reference.getMetric(), reference.getDelta(), [&](auto metric) {
+            return ScoreSoftplus(reference, s, bestscore, metric);
+        });
+    }
+
+private:
+    template<typename M>
+    score_t ScoreSoftplus(const Reference &reference, const double* s, double bestscore, M error) const
+    {
+        const double Vmin = reference.getVmin();
+        const double Vmax = reference.getVmax();
+
+        const double* vout = reference.getVout();
+        const double* weight = reference.getWeight();
+
+        const double bound = M::bound(bestscore);
+
+        const int W = simd::vdouble::width;
+        const simd::vdouble scale = simd::vdouble(0.) - simd::vdouble(1./theta[Logistic::V]);
+
+        const size_t n = reference.paddedSize();
+        for (size_t i = 0; i < n; i += W)
+        {
+            const simd::vdouble simval = simd::fma(simd::exp(simd::vdouble::load(s + i) * scale), Vmax-Vmin, Vmin);
+            error.add(GetResidual(simval, simd::vdouble::load(vout + i), simd::vdouble::load(weight + i)));
+
+            if (M::reduce(error.partial()) > bound)
+                break;
+        }
+
+        score_t score;
+        score.error = M::finish(M::reduce(error.total()));
         return score;
     }
 };
 
+/**
+ * Transpose the kernel constants of W candidates starting at k,
+ * padding with the last one.
+ */
+template<typename T>
+inline void PrepareBatch(const Parameters* params, size_t k, size_t K, simd::vdouble* c)
+{
+    const int W = simd::vdouble::width;
+    alignas(64) double lanes[T::C][W];
+    for (int j = 0; j < W; j++)
+    {
+        double constants[T::C];
+        T::prepare(params[std::min<size_t>(k + j, K - 1)].theta, constants);
+        for (int m = 0; m < T::C; m++)
+            lanes[m][j] = constants[m];
+    }
+    for (int m = 0; m < T::C; m++)
+        c[m] = simd::vdouble::load(lanes[m]);
+}
+
+template<typename T, typename M>
+inline void ScoreBatchGeneric(const Reference &reference, const Parameters* params, score_t* scores, size_t K, double bestscore, M metric)
+{
+    const int W = simd::vdouble::width;
+
+    const double Vmin = reference.getVmin();
+    const double Vmax = reference.getVmax();
+
+    const double* x = reference.getX();
+    const double* vout = reference.getVout();
+    const double* weight = reference.getWeight();
+
+    const simd::vdouble bound = M::bound(bestscore);
+
+    for (size_t k = 0; k < K; k += W)
+    {
+        simd::vdouble c[T::C];
+        PrepareBatch<T>(params, k, K, c);
+
+        M error = metric;
+
+        for (size_t i = 0; i < reference.size(); i++)
+        {
+            const simd::vdouble simval = simd::fma(T::kernel(simd::vdouble(x[i]), c), Vmax-Vmin, Vmin);
+            error.add(Parameters::GetResidual(simval, vout[i], weight[i]));
+
+            if (simd::all(error.partial() > bound))
+                break;
+        }
+
+        alignas(64) double result[W];
+        M::finish(error.total()).store(result);
+        for (size_t j = 0; j < std::min<size_t>(W, K - k); j++)
+        {
+            scores[k + j].error = result[j];
+        }
+    }
+}
+
+/**
+ * Score a batch of K candidates in a single pass over the reference data.
+ *
+ * Each SIMD lane holds a different candidate, so the samples are loaded
+ * once per group of candidates instead of once per candidate.
+ * As in Parameters::Score() a group is abandoned as soon as all of its
+ * candidates exceed the bestscore bound, the scores of those
+ * candidates are then only lower bounds of the real ones.
+ * All the candidates must use the same transfer function.
+ */
+inline void ScoreBatchGeneric(const Reference &reference, const Parameters* params, score_t* scores, size_t K, double bestscore)
+{
+    WithTransfer(params[0].transfer, [&](auto model) {
+        WithMetric(reference.getMetric(), reference.getDelta(), [&](auto metric) {
+            ScoreBatchGeneric<decltype(model)>(reference, params, scores, K, bestscore, metric);
+        });
+    });
+}
+
+template<typename T>
+inline void ScoreBatchFloat(const Reference &reference, const Parameters* params, score_t* scores, size_t K, double bestscore)
+{
+    const int W = simd::vfloat::width;
+
+    const float* x = reference.getXFloat();
+    const float* scale = reference.getScaleFloat();
+    const float* offset = reference.getOffsetFloat();
+
+    const simd::vfloat bound = static_cast<float>(bestscore * bestscore);
+
+    for (size_t k = 0; k < K; k += W)
+    {
+        // transpose the constants as in PrepareBatch()
+        alignas(64) float lanes[T::C][W];
+        for (int j = 0; j < W; j++)
+        {
+            double constants[T::C];
+            T::prepare(params[std::min<size_t>(k + j, K - 1)].theta, constants, reference.getCenter());
+            for (int m = 0; m < T::C; m++)
+                lanes[m][j] = static_cast<float>(constants[m]);
+        }
+        simd::vfloat c[T::C];
+        for (int m = 0; m < T::C; m++)
+            c[m] = simd::vfloat::load(lanes[m]);
+
+        simd::vfloat error = 0.f;
+
+        for (size_t i = 0; i < reference.size(); i++)
+        {
+            const simd::vfloat diff = simd::fma(T::kernel(simd::vfloat(x[i]), c), scale[i], offset[i]);
+            error = simd::fma(diff, diff, error);
+
+            if (simd::all(error > bound))
+                break;
+        }
+
+        alignas(64) float result[W];
+        error.store(result);
+        for (size_t j = 0; j < std::min<size_t>(W, K - k); j++)
+        {
+            scores[k + j].error = std::sqrt(static_cast<double>(result[j]));
+        }
+    }
+}
+
+/**
+ * ScoreBatchGeneric() in single precision, see Parameters::ScoreFloat().
+ */
+inline void ScoreBatchFloat(const Reference &reference, const Parameters* params, score_t* scores, size_t K, double bestscore)
+{
+    WithTransfer(params[0].transfer, [&](auto model) { ScoreBatchFloat<decltype(model)>(reference, params, scores, K, bestscore); });
+}
+
+/**
+ * ScoreBatchGeneric() of logistic candidates which all have the q and b
+ * of the parameters s was computed from, see Parameters::ScoreSoftplus().
+ */
+template<typename M>
+inline void ScoreBatchSoftplus(const Reference &reference, const double* s, const Parameters* params, score_t* scores, size_t K, double bestscore, M metric)
+{
+    const int W = simd::vdouble::width;
+
+    const double Vmin = reference.getVmin();
+    const double Vmax = reference.getVmax();
+
+    const double* vout = reference.getVout();
+    const double* weight = reference.getWeight();
+
+    const simd::vdouble bound = M::bound(bestscore);
+
+    for (size_t k = 0; k < K; k += W)
+    {
+        simd::vdouble c[Logistic::C];
+        PrepareBatch<Logistic>(params, k, K, c);
+        const simd::vdouble scale = simd::vdouble(0.) - c[2];
+
+        M error = metric;
+
+        for (size_t i = 0; i < reference.size(); i++)
+        {
+            const simd::vdouble simval = simd::fma(simd::exp(simd::vdouble(s[i]) * scale), Vmax-Vmin, Vmin);
+            error.add(Parameters::GetResidual(simval, vout[i], weight[i]));
+
+            if (simd::all(error.partial() > bound))
+                break;
+        }
+
+        alignas(64) double result[W];
+        M::finish(error.total()).store(result);
+        for (size_t j = 0; j < std::min<size_t>(W, K - k); j++)
+        {
+            scores[k + j].error = result[j];
+        }
+    }
+}
+
+inline void ScoreBatchSoftplus(const Reference &reference, const double* s, const Parameters* params, score_t* scores, size_t K, double bestscore)
+{
+    WithMetric(reference.getMetric(), reference.getDelta(), [&](auto metric) {
+        ScoreBatchSoftplus(reference, s, params, scores, K, bestscore, metric);
+    });
+}
+
+/**
+ * Score a batch of candidates, with the specialized kernel
+ * of the reference if it has one.
+ */
+inline void ScoreBatch(const Reference &reference, const Parameters* params, score_t* scores, size_t K, double bestscore)
+{
+    if (reference.getBatchKernel())
+        reference.getBatchKernel()(params, scores, K, bestscore);
+    else
+        ScoreBatchGeneric(reference, params, scores, K, bestscore);
+}
+
 #endif
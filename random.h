@@ -0,0 +1,308 @@
+/*
+ * This file is part of libsidplayfp, a SID player engine.
+ *
+ * Copyright 2023 Leandro Nini <drfiemost@users.sourceforge.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <cmath>
+#include <cstdint>
+
+#include <random>
+#include <chrono>
+#include <istream>
+#include <ostream>
+#ifdef __MINGW32__
+#  include <thread>
+#  include <functional>
+#endif
+
+/*
+ * Random number generation for the optimizer.
+ *
+ * The engine is selected at build time:
+ *   RNG_XOSHIRO  xoshiro256++ (default)
+ *   RNG_PCG      PCG32 XSH-RR
+ *   RNG_STD      std::default_random_engine, the original generator
+ * Every engine provides next(), returning 64 random bits, and
+ * seed(seed, stream) giving independent streams from a single seed.
+ * Normal deviates come from a ziggurat sampler on top of the engine.
+ * The generators are owned by their users, the chains and the fit,
+ * and passed down, there is no process wide state.
+ */
+
+#if !defined(RNG_PCG) && !defined(RNG_STD) && !defined(RNG_XOSHIRO)
+#  define RNG_XOSHIRO
+#endif
+
+// SplitMix64, used to expand the seeds
+inline uint64_t SplitMix64(uint64_t &state)
+{
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/**
+ * xoshiro256++ by Blackman and Vigna.
+ * Streams are 2^128 draws apart, using the jump polynomial.
+ */
+class Xoshiro256pp
+{
+private:
+    uint64_t s[4];
+
+    static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+public:
+    static constexpr const char* name = "xoshiro256++";
+
+    explicit Xoshiro256pp(uint64_t seed) { this->seed(seed, 0); }
+
+    uint64_t next()
+    {
+        const uint64_t result = rotl(s[0] + s[3], 23) + s[0];
+        const uint64_t t = s[1] << 17;
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+        return result;
+    }
+
+    // equivalent to 2^128 calls to next()
+    void jump()
+    {
+        static const uint64_t JUMP[] = { 0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL, 0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL };
+
+        uint64_t t[4] = { 0, 0, 0, 0 };
+        for (uint64_t j: JUMP)
+        {
+            for (int b = 0; b < 64; b++)
+            {
+                if (j & (uint64_t(1) << b))
+                {
+                    for (int i = 0; i < 4; i++)
+                        t[i] ^= s[i];
+                }
+                next();
+            }
+        }
+        for (int i = 0; i < 4; i++)
+            s[i] = t[i];
+    }
+
+    void seed(uint64_t seed, uint64_t stream)
+    {
+        for (int i = 0; i < 4; i++)
+            s[i] = SplitMix64(seed);
+        for (uint64_t i = 0; i < stream; i++)
+            jump();
+    }
+
+    void save(std::ostream &os) const { os << s[0] << " " << s[1] << " " << s[2] << " " << s[3]; }
+    bool load(std::istream &is) { return static_cast<bool>(is >> s[0] >> s[1] >> s[2] >> s[3]); }
+};
+
+/**
+ * PCG32 (XSH-RR) by O'Neill.
+ * Streams use distinct increments of the underlying LCG.
+ */
+class Pcg32
+{
+private:
+    uint64_t state;
+    uint64_t inc;
+
+    uint32_t next32()
+    {
+        const uint64_t old = state;
+        state = old * 6364136223846793005ULL + inc;
+        const uint32_t xorshifted = static_cast<uint32_t>(((old >> 18) ^ old) >> 27);
+        const uint32_t rot = static_cast<uint32_t>(old >> 59);
+        return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+    }
+
+public:
+    static constexpr const char* name = "pcg32";
+
+    explicit Pcg32(uint64_t seed) { this->seed(seed, 0); }
+
+    uint64_t next()
+    {
+        const uint64_t hi = next32();
+        return (hi << 32) | next32();
+    }
+
+    void seed(uint64_t seed, uint64_t stream)
+    {
+        state = 0;
+        inc = (stream << 1) | 1;
+        next32();
+        state += SplitMix64(seed);
+        next32();
+    }
+
+    void save(std::ostream &os) const { os << state << " " << inc; }
+    bool load(std::istream &is) { return static_cast<bool>(is >> state >> inc); }
+};
+
+/**
+ * The original minstd generator, 31 bits per call.
+ */
+class StdEngine
+{
+private:
+    std::default_random_engine e;
+
+public:
+    static constexpr const char* name = "minstd";
+
+    explicit StdEngine(uint64_t seed) : e(static_cast<std::default_random_engine::result_type>(seed)) {}
+
+    uint64_t next()
+    {
+        const uint64_t a = e();
+        const uint64_t b = e();
+        const uint64_t c = e();
+        return (a << 33) ^ (b << 2) ^ c;
+    }
+
+    void seed(uint64_t seed, uint64_t stream)
+    {
+        e.seed(static_cast<std::default_random_engine::result_type>(seed + stream));
+    }
+
+    void save(std::ostream &os) const { os << e; }
+    bool load(std::istream &is) { return static_cast<bool>(is >> e); }
+};
+
+#if defined(RNG_PCG)
+typedef Pcg32 Rng;
+#elif defined(RNG_STD)
+typedef StdEngine Rng;
+#else
+typedef Xoshiro256pp Rng;
+#endif
+
+#ifdef __MINGW32__
+// MinGW's std::random_device is a PRNG seeded with a constant value
+// so we use system time as a random seed.
+inline uint64_t getSeed()
+{
+    using namespace std::chrono;
+    const auto now_ms = time_point_cast<std::chrono::milliseconds>(system_clock::now());
+    // mix in the thread id so that workers started together get different seeds
+    return now_ms.time_since_epoch().count() ^ std::hash<std::thread::id>{}(std::this_thread::get_id());
+}
+#else
+inline uint64_t getSeed()
+{
+    std::random_device rd;
+    return (static_cast<uint64_t>(rd()) << 32) ^ rd();
+}
+#endif
+
+// random bits, for cheap coin flips
+inline uint64_t GetRandomBits(Rng &rng)
+{
+    return rng.next();
+}
+
+// uniform in (0, 1), never exactly zero
+inline double GetUniform(Rng &rng)
+{
+    return ((rng.next() >> 11) + 0.5) * 0x1.0p-53;
+}
+
+/**
+ * Ziggurat tables for the normal distribution, 128 layers
+ * (Marsaglia and Tsang, with the improvements of Doornik).
+ */
+struct ziggurat_t
+{
+    static constexpr int LAYERS = 128;
+    static constexpr double R = 3.442619855899;
+    static constexpr double V = 9.91256303526217e-3;
+
+    double x[LAYERS + 1];
+    // x[i+1]/x[i], the fraction of the layer fully under the curve
+    double r[LAYERS];
+
+    ziggurat_t()
+    {
+        double f = std::exp(-0.5 * R * R);
+        x[0] = V / f;
+        x[1] = R;
+        x[LAYERS] = 0.;
+        for (int i = 2; i < LAYERS; i++)
+        {
+            x[i] = std::sqrt(-2. * std::log(V / x[i - 1] + f));
+            f = std::exp(-0.5 * x[i] * x[i]);
+        }
+        for (int i = 0; i < LAYERS; i++)
+            r[i] = x[i + 1] / x[i];
+    }
+};
+
+static const ziggurat_t ziggurat;
+
+// standard normal deviate
+inline double GetGaussian(Rng &rng)
+{
+    for (;;)
+    {
+        const uint64_t bits = rng.next();
+        // top 53 bits give a signed uniform, the low 7 the layer
+        const double u = 2. * ((bits >> 11) * 0x1.0p-53) - 1.;
+        const int i = bits & (ziggurat_t::LAYERS - 1);
+
+        // common case, about 99% of the draws
+        if (std::abs(u) < ziggurat.r[i])
+            return u * ziggurat.x[i];
+
+        if (i == 0)
+        {
+            // tail beyond R
+            double x, y;
+            do
+            {
+                x = std::log(GetUniform(rng)) / ziggurat_t::R;
+                y = std::log(GetUniform(rng));
+            } while (-2. * y < x * x);
+            return u < 0. ? x - ziggurat_t::R : ziggurat_t::R - x;
+        }
+
+        const double x = u * ziggurat.x[i];
+        const double f0 = std::exp(-0.5 * (ziggurat.x[i] * ziggurat.x[i] - x * x));
+        const double f1 = std::exp(-0.5 * (ziggurat.x[i + 1] * ziggurat.x[i + 1] - x * x));
+        if (f1 + GetUniform(rng) * (f0 - f1) < 1.)
+            return x;
+    }
+}
+
+inline double GetNewRandomValue(Rng &rng)
+{
+    return 0.5 + 0.2 * GetGaussian(rng);
+}
+
+#endif
@@ -0,0 +1,324 @@
+/*
+ * This file is part of libsidplayfp, a SID player engine.
+ *
+ * Copyright 2023 Leandro Nini <drfiemost@users.sourceforge.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef REFERENCE_H
+#define REFERENCE_H
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <string>
+#include <sstream>
+#include <limits>
+#include <vector>
+
+#include "simd.h"
+#include "metric.h"
+
+typedef struct
+{
+    double Vin;
+    double Vout;
+} data_t;
+
+typedef std::vector<data_t> ref_vector_t;
+
+class Parameters;
+struct score_t;
+
+// scoring functions specialized for a given dataset, see model.h
+typedef score_t (*score_kernel_t)(const Parameters &params, double bestscore);
+typedef void (*batch_kernel_t)(const Parameters* params, score_t* scores, std::size_t K, double bestscore);
+
+// Cache line aligned allocator for the SIMD arrays
+template<typename T>
+struct aligned_allocator
+{
+    typedef T value_type;
+
+    static const std::size_t alignment = 64;
+
+    aligned_allocator() {}
+    template<typename U> aligned_allocator(const aligned_allocator<U>&) {}
+
+    T* allocate(std::size_t n)
+    {
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(alignment)));
+    }
+
+    void deallocate(T* p, std::size_t)
+    {
+        ::operator delete(p, std::align_val_t(alignment));
+    }
+
+    template<typename U> bool operator==(const aligned_allocator<U>&) const { return true; }
+    template<typename U> bool operator!=(const aligned_allocator<U>&) const { return false; }
+};
+
+typedef std::vector<double, aligned_allocator<double>> aligned_vector_t;
+typedef std::vector<float, aligned_allocator<float>> aligned_float_vector_t;
+
+/**
+ * Reference data prepared for scoring.
+ *
+ * The samples are stored as separate aligned arrays holding
+ * the input voltage shifted by Vmin, the output voltage
+ * and its reciprocal, used as weight for the relative error.
+ * The arrays are padded to a multiple of the SIMD width with
+ * zero weight entries so the scoring loop never needs a tail.
+ *
+ * As in the original tables the first sample of a ref_vector_t
+ * holds the voltage range: Vin is Vmin and Vout is Vmax.
+ * Measured curves pass the range along with the arrays.
+ *
+ * The weights can be raised over ranges of the input, and the
+ * residuals reduced with another metric than the squared error,
+ * together they make the objective of the fit.
+ *
+ * A single precision copy is kept for screening candidates.
+ * There the inputs are shifted by a center close to the steep part
+ * of the curve instead of Vmin, see Logistic::prepare(), and the
+ * residual (Vmin + (Vmax-Vmin)*g - Vout)/Vout is computed as
+ * g*scale + offset, with a single rounding.
+ */
+class Reference
+{
+private:
+    double Vmin;
+    double Vmax;
+
+    std::size_t n;
+
+    aligned_vector_t x;
+    aligned_vector_t vout;
+    aligned_vector_t weight;
+
+    // single precision copy
+    double center;
+    aligned_float_vector_t xf;
+    aligned_float_vector_t scalef;
+    aligned_float_vector_t offsetf;
+
+    score_kernel_t scoreKernel = nullptr;
+    batch_kernel_t batchKernel = nullptr;
+
+    Metric_t metric = Metric_t::L2;
+    double delta = 0.;
+    std::vector<region_t> regions;
+
+private:
+    void allocate()
+    {
+        const std::size_t W = simd::vdouble::width;
+        const std::size_t padded = (n + W - 1) / W * W;
+
+        x.resize(padded, 0.);
+        vout.resize(padded, 0.);
+        weight.resize(padded, 0.);
+    }
+
+    void set(std::size_t i, double Vin, double Vout)
+    {
+        x[i] = Vin - Vmin;
+        vout[i] = Vout;
+        weight[i] = 1. / Vout;
+    }
+
+    // the center is the sample closest to the middle of the output range
+    void setFloat()
+    {
+        const double mid = 0.5 * (Vmin + Vmax);
+        std::size_t c = 0;
+        for (std::size_t i = 1; i < n; i++)
+        {
+            if (std::abs(vout[i] - mid) < std::abs(vout[c] - mid))
+                c = i;
+        }
+        center = x[c];
+
+        const std::size_t W = simd::vfloat::width;
+        const std::size_t padded = (n + W - 1) / W * W;
+        xf.assign(padded, 0.f);
+        scalef.assign(padded, 0.f);
+        offsetf.assign(padded, 0.f);
+        for (std::size_t i = 0; i < n; i++)
+        {
+            xf[i] = static_cast<float>(x[i] - center);
+            scalef[i] = static_cast<float>((Vmax - Vmin) * weight[i]);
+            offsetf[i] = static_cast<float>((Vmin - vout[i]) * weight[i]);
+        }
+    }
+
+public:
+    Reference(const ref_vector_t &data) :
+        Vmin(data[0].Vin),
+        Vmax(data[0].Vout),
+        n(data.size())
+    {
+        allocate();
+        for (std::size_t i = 0; i < n; i++)
+            set(i, data[i].Vin, data[i].Vout);
+        setFloat();
+    }
+
+    /**
+     * Build from separate input and output arrays,
+     * as found in the binary files, and the voltage range.
+     * All the samples are measurements.
+     */
+    template<typename T>
+    Reference(const T* Vin, const T* Vout, std::size_t count, double vmin, double vmax) :
+        Vmin(vmin),
+        Vmax(vmax),
+        n(count)
+    {
+        allocate();
+        for (std::size_t i = 0; i < n; i++)
+            set(i, Vin[i], Vout[i]);
+        setFloat();
+    }
+
+    double getVmin() const { return Vmin; }
+    double getVmax() const { return Vmax; }
+
+    /// Number of samples
+    std::size_t size() const { return n; }
+
+    /// Number of samples including padding
+    std::size_t paddedSize() const { return x.size(); }
+
+    /// Shifted input voltage, Vin - Vmin
+    const double* getX() const { return x.data(); }
+
+    /// Measured output voltage
+    const double* getVout() const { return vout.data(); }
+
+    /// 1/Vout, zero for padding
+    const double* getWeight() const { return weight.data(); }
+
+    /// Input shift of the single precision copy, in volts
+    double getCenter() const { return center; }
+
+    /// Number of single precision samples including padding
+    std::size_t paddedFloatSize() const { return xf.size(); }
+
+    /// Input voltage in single precision, Vin - Vmin - center
+    const float* getXFloat() const { return xf.data(); }
+
+    /// (Vmax-Vmin)/Vout in single precision, zero for padding
+    const float* getScaleFloat() const { return scalef.data(); }
+
+    /// (Vmin-Vout)/Vout in single precision, zero for padding
+    const float* getOffsetFloat() const { return offsetf.data(); }
+
+    /**
+     * Use the given kernels instead of the generic loops,
+     * they must score against the same samples.
+     */
+    void setKernels(score_kernel_t score, batch_kernel_t batch)
+    {
+        scoreKernel = score;
+        batchKernel = batch;
+    }
+
+    score_kernel_t getScoreKernel() const { return scoreKernel; }
+    batch_kernel_t getBatchKernel() const { return batchKernel; }
+
+    /**
+     * Reduce the residuals with the given metric, delta is the
+     * threshold of the Huber loss. The specialized kernels
+     * only know the squared error and are dropped for the others.
+     */
+    void setMetric(Metric_t m, double d)
+    {
+        metric = m;
+        delta = d;
+        if (metric != Metric_t::L2)
+            setKernels(nullptr, nullptr);
+    }
+
+    Metric_t getMetric() const { return metric; }
+    double getDelta() const { return delta; }
+
+    /**
+     * Multiply the weights of the samples with lo <= Vin <= hi by w,
+     * to emphasize e.g. the working point around Vin = Vout.
+     * The specialized kernels have the weights built in and are dropped.
+     */
+    void emphasize(const region_t &region)
+    {
+        regions.push_back(region);
+        for (std::size_t i = 0; i < n; i++)
+        {
+            const double Vin = x[i] + Vmin;
+            if (Vin >= region.lo && Vin <= region.hi)
+                weight[i] *= region.weight;
+        }
+        setFloat();
+        setKernels(nullptr, nullptr);
+    }
+
+    /**
+     * Bootstrap replicate of base, a copy of it or of another replicate:
+     * sample i is drawn counts[i] times, its weight is the one in base
+     * scaled by sqrt(counts[i]) so that its squared residual counts
+     * that many times, and the ones not drawn are left out like the padding.
+     * Only the weights are rewritten, nothing is allocated.
+     */
+    void resample(const Reference &base, const unsigned int* counts)
+    {
+        for (std::size_t i = 0; i < n; i++)
+            weight[i] = base.weight[i] * std::sqrt(static_cast<double>(counts[i]));
+        setFloat();
+        setKernels(nullptr, nullptr);
+    }
+
+    /// Metric and regions as text, identifies the objective along with hash()
+    std::string objective() const
+    {
+        std::ostringstream os;
+        os.precision(std::numeric_limits<double>::max_digits10);
+        os << toString(metric);
+        if (metric == Metric_t::HUBER)
+            os << " " << delta;
+        for (const region_t &r: regions)
+            os << " region " << r.lo << " " << r.hi << " " << r.weight;
+        return os.str();
+    }
+
+    /// FNV-1a hash of the samples, identifies the dataset
+    uint64_t hash() const
+    {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        auto add = [&h](const void* data, std::size_t size) {
+            const unsigned char* p = static_cast<const unsigned char*>(data);
+            for (std::size_t i = 0; i < size; i++)
+                h = (h ^ p[i]) * 0x100000001b3ULL;
+        };
+        add(&Vmin, sizeof(Vmin));
+        add(&Vmax, sizeof(Vmax));
+        add(x.data(), n * sizeof(double));
+        add(vout.data(), n * sizeof(double));
+        return h;
+    }
+};
+
+#endif
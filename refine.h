@@ -0,0 +1,229 @@
+/*
+ * This file is part of libsidplayfp, a SID player engine.
+ *
+ * Copyright 2023 Leandro Nini <drfiemost@users.sourceforge.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef REFINE_H
+#define REFINE_H
+
+#include <cmath>
+#include <chrono>
+#include <utility>
+#include <array>
+#include <vector>
+#include <limits>
+
+#include "parameters.h"
+#include "reference.h"
+
+struct refine_t
+{
+    unsigned int iterations;
+    double seconds;
+    score_t score;
+};
+
+/**
+ * Residuals r_i = (y_i - Vref_i)/Vref_i and their analytic Jacobian
+ * with respect to the parameters theta, where y = Vmin + (Vmax-Vmin)*g(x)
+ * and g is the transfer function of params.
+ *
+ * Working on log(q), which is also how Parameters stores it, keeps
+ * the problem well conditioned, q spans hundreds of orders of magnitude
+ * between chips.
+ *
+ * @return the sum of squared residuals
+ */
+inline double Residuals(const Reference &reference, const Parameters &params, double* r, std::array<double, MAX_PARAMS>* J)
+{
+    const double Vmin = reference.getVmin();
+    const double R = reference.getVmax() - Vmin;
+
+    const double* x = reference.getX();
+    const double* vout = reference.getVout();
+    const double* weight = reference.getWeight();
+
+    const int N = params.size();
+
+    double cost = 0.;
+    for (size_t i = 0; i < reference.size(); i++)
+    {
+        double gradient[MAX_PARAMS];
+        const double g = J ? params.GetGradient(x[i], gradient) : params.GetNormalized(x[i]);
+
+        r[i] = (Vmin + R*g - vout[i])*weight[i];
+        cost += r[i]*r[i];
+
+        if (J)
+        {
+            for (int a = 0; a < N; a++)
+                J[i][a] = R*weight[i]*gradient[a];
+        }
+    }
+    return cost;
+}
+
+/**
+ * Solve the n by n system A*x = y with Gaussian elimination
+ * and partial pivoting.
+ *
+ * @return false if the matrix is singular
+ */
+inline bool Solve(double A[MAX_PARAMS][MAX_PARAMS], double y[MAX_PARAMS], double x[MAX_PARAMS], int n)
+{
+    for (int c = 0; c < n; c++)
+    {
+        int pivot = c;
+        for (int k = c + 1; k < n; k++)
+        {
+            if (std::abs(A[k][c]) > std::abs(A[pivot][c]))
+                pivot = k;
+        }
+        if (A[pivot][c] == 0.)
+            return false;
+        if (pivot != c)
+        {
+            for (int k = 0; k < n; k++)
+                std::swap(A[c][k], A[pivot][k]);
+            std::swap(y[c], y[pivot]);
+        }
+        for (int k = c + 1; k < n; k++)
+        {
+            const double f = A[k][c] / A[c][c];
+            for (int j = c; j < n; j++)
+                A[k][j] -= f * A[c][j];
+            y[k] -= f * y[c];
+        }
+    }
+    for (int c = n - 1; c >= 0; c--)
+    {
+        double sum = y[c];
+        for (int k = c + 1; k < n; k++)
+            sum -= A[c][k] * x[k];
+        x[c] = sum / A[c][c];
+    }
+    return true;
+}
+
+// the parameters must stay in the domain of the transfer function
+inline bool IsValid(const Parameters &params)
+{
+    for (int i = 0; i < params.size(); i++)
+    {
+        if (!std::isfinite(params.theta[i]) || (params.role(i) == Param_t::V && !(params.theta[i] > 0.)))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Levenberg-Marquardt refinement of the parameters.
+ *
+ * The parameters are only replaced if the result scores better
+ * than the starting point.
+ */
+inline refine_t Refine(const Reference &reference, Parameters &params, unsigned int maxIterations = 1000)
+{
+    const auto start = std::chrono::steady_clock::now();
+
+    const size_t n = reference.size();
+    const int N = params.size();
+    std::vector<double> r(n), rnew(n);
+    std::vector<std::array<double, MAX_PARAMS>> J(n);
+
+    Parameters theta = params;
+    double cost = Residuals(reference, theta, r.data(), J.data());
+    double lambda = 1e-3;
+
+    unsigned int iteration = 0;
+    while (iteration < maxIterations)
+    {
+        iteration++;
+
+        // normal equations J'J*delta = -J'r
+        double JtJ[MAX_PARAMS][MAX_PARAMS] = {};
+        double Jtr[MAX_PARAMS] = {};
+        for (size_t i = 0; i < n; i++)
+        {
+            for (int a = 0; a < N; a++)
+            {
+                Jtr[a] -= J[i][a] * r[i];
+                for (int c = 0; c < N; c++)
+                    JtJ[a][c] += J[i][a] * J[i][c];
+            }
+        }
+
+        // try increasing damping until the step improves the cost
+        bool accepted = false;
+        double delta[MAX_PARAMS];
+        while (lambda < 1e16)
+        {
+            double A[MAX_PARAMS][MAX_PARAMS];
+            double y[MAX_PARAMS];
+            for (int a = 0; a < N; a++)
+            {
+                y[a] = Jtr[a];
+                for (int c = 0; c < N; c++)
+                    A[a][c] = JtJ[a][c];
+                A[a][a] += lambda * JtJ[a][a];
+            }
+
+            if (Solve(A, y, delta, N))
+            {
+                Parameters newtheta = theta;
+                for (int a = 0; a < N; a++)
+                    newtheta.theta[a] += delta[a];
+
+                if (IsValid(newtheta))
+                {
+                    const double newcost = Residuals(reference, newtheta, rnew.data(), nullptr);
+                    if (newcost < cost)
+                    {
+                        const double gain = cost - newcost;
+                        theta = newtheta;
+                        cost = Residuals(reference, theta, r.data(), J.data());
+                        lambda = std::max(lambda * 0.1, 1e-12);
+                        accepted = gain > cost * 1e-15;
+                        break;
+                    }
+                }
+            }
+            lambda *= 10.;
+        }
+
+        // converged, no further progress possible
+        if (!accepted)
+            break;
+    }
+
+    refine_t result;
+    result.iterations = iteration;
+    result.score = params.Score(reference, nullptr, std::numeric_limits<double>::infinity());
+
+    const score_t score = theta.Score(reference, nullptr, std::numeric_limits<double>::infinity());
+    if (result.score.isBetter(score))
+    {
+        params = theta;
+        result.score = score;
+    }
+
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+#endif
@@ -0,0 +1,522 @@
+/*
+ * This file is part of libsidplayfp, a SID player engine.
+ *
+ * Copyright 2023 Leandro Nini <drfiemost@users.sourceforge.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef REPORTER_H
+#define REPORTER_H
+
+#include <cstdint>
+#include <cmath>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "parameters.h"
+
+// Per thread statistics
+struct stats_t
+{
+    uint64_t trials = 0;
+    uint64_t improvements = 0;
+    uint64_t entropy = 0;
+    // timing is sampled, see SAMPLE_INTERVAL
+    uint64_t sampledScores = 0;
+    uint64_t sampledNs = 0;
+};
+
+/**
+ * Statistics line: throughput, acceptance rate
+ * and average time per scored candidate.
+ */
+inline std::string FormatStats(const char* prefix, const stats_t &stats, double elapsed)
+{
+    std::ostringstream ss;
+    ss << prefix << stats.trials << " trials in " << elapsed << " s ("
+        << static_cast<uint64_t>(stats.trials / elapsed) << " trials/s), "
+        << stats.improvements << " improvements (" << (stats.trials ? 100. * stats.improvements / stats.trials : 0.) << "%), "
+        << stats.entropy << " entropy moves";
+    if (stats.sampledScores)
+        ss << ", " << static_cast<double>(stats.sampledNs) / stats.sampledScores << " ns/score";
+    return ss.str();
+}
+
+enum class Output_t
+{
+    // the traditional comment lines
+    HUMAN,
+    // one JSON object per line
+    JSON
+};
+
+enum class Report_t
+{
+    MESSAGE,
+    INITIAL,
+    REFINED,
+    SWEEP,
+    CACHED,
+    SEED,
+    RUNNING,
+    IMPROVEMENT,
+    STATUS,
+    STOPPED,
+    TOTAL,
+    THREAD,
+    ISLAND,
+    BEST_ISLAND,
+    BEST,
+    FINAL
+};
+
+// A progress record, which fields are used depends on the kind
+struct report_t
+{
+    Report_t kind = Report_t::MESSAGE;
+    // island or thread, and how many of them there are
+    unsigned int index = 0;
+    unsigned int total = 1;
+    // trials, iterations or threads
+    uint64_t count = 0;
+    // seconds
+    double time = 0.;
+    double error = 0.;
+    Parameters params;
+    stats_t stats;
+    // only for messages and stop reasons, never set on the hot path
+    std::string text;
+
+    void setParameters(const Parameters &p, const score_t &score)
+    {
+        params = p;
+        error = score.error;
+    }
+};
+
+/**
+ * Bounded lock-free multi producer single consumer queue,
+ * after Dmitry Vyukov's bounded MPMC queue: each cell carries
+ * a sequence number telling whether it is free for the producer
+ * of a given position or ready for the consumer.
+ */
+template<typename T>
+class Ring
+{
+private:
+    struct cell_t
+    {
+        std::atomic<size_t> seq;
+        T data;
+    };
+
+    const size_t mask;
+    std::unique_ptr<cell_t[]> cells;
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) size_t tail;
+
+public:
+    // size must be a power of two
+    explicit Ring(size_t size) :
+        mask(size - 1),
+        cells(new cell_t[size]),
+        head(0),
+        tail(0)
+    {
+        for (size_t i = 0; i < size; i++)
+            cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    // @return false if the ring is full
+    bool push(T &&value)
+    {
+        size_t pos = head.load(std::memory_order_relaxed);
+        cell_t* cell;
+        for (;;)
+        {
+            cell = &cells[pos & mask];
+            const size_t seq = cell->seq.load(std::memory_order_acquire);
+            const intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0)
+            {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+                return false;
+            else
+                pos = head.load(std::memory_order_relaxed);
+        }
+        cell->data = std::move(value);
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer only, @return false if the ring is empty
+    bool pop(T &value)
+    {
+        cell_t &cell = cells[tail & mask];
+        if (cell.seq.load(std::memory_order_acquire) != tail + 1)
+            return false;
+        value = std::move(cell.data);
+        cell.seq.store(tail + mask + 1, std::memory_order_release);
+        tail++;
+        return true;
+    }
+};
+
+/**
+ * Progress output off the search threads.
+ *
+ * Producers push records into a ring and go on, a background thread
+ * formats them and writes them out, flushing only when it has caught up.
+ * Records from the search threads are dropped if the ring is full,
+ * the ones from the main thread wait for room, so the summary
+ * is always complete and in order.
+ *
+ * Instead of a stream the records can go to a callback,
+ * which is then called on the background thread.
+ */
+class Reporter
+{
+private:
+    static const size_t RING_SIZE = 1024;
+
+    std::ostream* out;
+    const Output_t format;
+    const std::function<void(const report_t&)> sink;
+
+    Ring<report_t> ring;
+    std::atomic<uint64_t> pushed;
+    std::atomic<uint64_t> written;
+    std::atomic<uint64_t> dropped;
+    std::atomic<bool> stopping;
+    std::thread writer;
+
+private:
+    static void writeNumber(std::ostream &os, double d)
+    {
+        if (std::isfinite(d))
+            os << d;
+        else
+            os << "null";
+    }
+
+    static void writeString(std::ostream &os, const std::string &s)
+    {
+        os << '"';
+        for (char c: s)
+        {
+            switch (c)
+            {
+            case '"': os << "\\\""; break;
+            case '\\': os << "\\\\"; break;
+            case '\n': os << "\\n"; break;
+            case '\t': os << "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20)
+                {
+                    static const char hex[] = "0123456789abcdef";
+                    os << "\\u00" << hex[(c >> 4) & 0xf] << hex[c & 0xf];
+                }
+                else
+                    os << c;
+            }
+        }
+        os << '"';
+    }
+
+    static std::string toString(const report_t &r)
+    {
+        return r.params.toString();
+    }
+
+    void writeHuman(const report_t &r)
+    {
+        std::ostream &out = *this->out;
+        score_t score;
+        score.error = r.error;
+
+        switch (r.kind)
+        {
+        case Report_t::MESSAGE:
+            out << r.text << '\n';
+            break;
+        case Report_t::INITIAL:
+            out << "# initial score " << std::dec << score << '\n' << toString(r) << "\n\n";
+            break;
+        case Report_t::REFINED:
+        case Report_t::FINAL:
+            out << "# refined score " << std::dec
+                << score << " (" << r.count << " iterations, "
+                << r.time * 1000. << " ms)" << '\n'
+                << toString(r) << (r.kind == Report_t::REFINED ? "\n\n" : "\n");
+            break;
+        case Report_t::SWEEP:
+            out << "# sweep of " << r.count << " candidates on " << r.text << " in "
+                << r.time * 1000. << " ms, best score " << std::dec << score << '\n'
+                << toString(r) << "\n\n";
+            break;
+        case Report_t::CACHED:
+            out << "# " << r.count << " sweep candidates from " << r.text << ", best score " << std::dec << score << '\n'
+                << toString(r) << "\n\n";
+            break;
+        case Report_t::SEED:
+            out << "# island " << r.index << " seed score " << std::dec << score << '\n' << toString(r) << "\n\n";
+            break;
+        case Report_t::RUNNING:
+            out << "# running " << r.count << " threads" << '\n';
+            break;
+        case Report_t::IMPROVEMENT:
+            out << "# current score " << std::dec << score;
+            if (r.total > 1)
+                out << " (island " << r.index << ")";
+            out << '\n' << toString(r) << "\n\n";
+            break;
+        case Report_t::STATUS:
+            out << FormatStats("# status: ", r.stats, r.time) << '\n';
+            break;
+        case Report_t::STOPPED:
+            out << "# stopped: " << r.text << '\n';
+            break;
+        case Report_t::TOTAL:
+            out << FormatStats("# total: ", r.stats, r.time) << '\n';
+            break;
+        case Report_t::THREAD:
+            out << "# thread " << r.index << FormatStats(": ", r.stats, r.time) << '\n';
+            break;
+        case Report_t::ISLAND:
+            out << "# island " << r.index << " score " << score << '\n';
+            break;
+        case Report_t::BEST_ISLAND:
+            out << "# best island " << r.index << '\n';
+            break;
+        case Report_t::BEST:
+            out << "# best score " << std::dec << score << '\n' << toString(r) << '\n';
+            break;
+        }
+    }
+
+    void writeJson(const report_t &r)
+    {
+        static const char* const names[] = {
+            "message", "initial", "refined", "sweep", "cached", "seed", "running", "improvement", "status",
+            "stopped", "total", "thread", "island", "best_island", "best", "final"
+        };
+
+        std::ostringstream os;
+        os.precision(std::numeric_limits<double>::max_digits10);
+        os << "{\"event\": \"" << names[static_cast<int>(r.kind)] << "\"";
+
+        auto params = [&os, &r]() {
+            os << ", \"score\": ";
+            writeNumber(os, r.error);
+            if (r.params.transfer != Transfer_t::LOGISTIC)
+                os << ", \"model\": \"" << ::toString(r.params.transfer) << "\"";
+            for (int i = 0; i < r.params.size(); i++)
+            {
+                os << ", \"" << r.params.name(i) << "\": ";
+                writeNumber(os, r.params.theta[i]);
+            }
+        };
+        auto stats = [&os, &r]() {
+            os << ", \"trials\": " << r.stats.trials
+               << ", \"improvements\": " << r.stats.improvements
+               << ", \"entropy\": " << r.stats.entropy
+               << ", \"seconds\": ";
+            writeNumber(os, r.time);
+            if (r.stats.sampledScores)
+                os << ", \"ns_per_score\": " << static_cast<double>(r.stats.sampledNs) / r.stats.sampledScores;
+        };
+
+        switch (r.kind)
+        {
+        case Report_t::MESSAGE:
+            os << ", \"text\": ";
+            writeString(os, r.text);
+            break;
+        case Report_t::STOPPED:
+            os << ", \"reason\": ";
+            writeString(os, r.text);
+            break;
+        case Report_t::INITIAL:
+        case Report_t::BEST:
+            params();
+            break;
+        case Report_t::REFINED:
+        case Report_t::FINAL:
+            params();
+            os << ", \"iterations\": " << r.count << ", \"ms\": " << r.time * 1000.;
+            break;
+        case Report_t::SWEEP:
+            os << ", \"candidates\": " << r.count << ", \"device\": ";
+            writeString(os, r.text);
+            os << ", \"ms\": " << r.time * 1000.;
+            params();
+            break;
+        case Report_t::CACHED:
+            os << ", \"candidates\": " << r.count << ", \"file\": ";
+            writeString(os, r.text);
+            params();
+            break;
+        case Report_t::SEED:
+            os << ", \"island\": " << r.index;
+            params();
+            break;
+        case Report_t::RUNNING:
+            os << ", \"threads\": " << r.count;
+            break;
+        case Report_t::IMPROVEMENT:
+            os << ", \"island\": " << r.index << ", \"trials\": " << r.count << ", \"seconds\": ";
+            writeNumber(os, r.time);
+            params();
+            break;
+        case Report_t::STATUS:
+        case Report_t::TOTAL:
+            stats();
+            break;
+        case Report_t::THREAD:
+            os << ", \"thread\": " << r.index;
+            stats();
+            break;
+        case Report_t::ISLAND:
+            os << ", \"island\": " << r.index;
+            params();
+            break;
+        case Report_t::BEST_ISLAND:
+            os << ", \"island\": " << r.index;
+            break;
+        }
+        os << "}";
+        *out << os.str() << '\n';
+    }
+
+    void write(const report_t &r)
+    {
+        if (sink)
+            sink(r);
+        else if (format == Output_t::JSON)
+            writeJson(r);
+        else
+            writeHuman(r);
+    }
+
+    void run()
+    {
+        report_t r;
+        for (;;)
+        {
+            // check before draining, so nothing pushed before stop() is missed
+            const bool last = stopping.load(std::memory_order_acquire);
+
+            bool any = false;
+            while (ring.pop(r))
+            {
+                write(r);
+                written.fetch_add(1, std::memory_order_release);
+                any = true;
+            }
+            if (any && out)
+                out->flush();
+
+            if (last)
+                return;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+public:
+    Reporter(std::ostream &out, Output_t format) :
+        out(&out),
+        format(format),
+        ring(RING_SIZE),
+        pushed(0),
+        written(0),
+        dropped(0),
+        stopping(false),
+        writer(&Reporter::run, this)
+    {}
+
+    explicit Reporter(std::function<void(const report_t&)> sink) :
+        out(nullptr),
+        format(Output_t::JSON),
+        sink(std::move(sink)),
+        ring(RING_SIZE),
+        pushed(0),
+        written(0),
+        dropped(0),
+        stopping(false),
+        writer(&Reporter::run, this)
+    {}
+
+    ~Reporter()
+    {
+        stopping.store(true, std::memory_order_release);
+        writer.join();
+        if (dropped)
+        {
+            report_t r;
+            r.text = "# " + std::to_string(dropped.load()) + " reports dropped";
+            write(r);
+            if (out)
+                out->flush();
+        }
+    }
+
+    Output_t getFormat() const { return format; }
+
+    // from the search threads, never blocks
+    void post(report_t &&r)
+    {
+        if (ring.push(std::move(r)))
+            pushed.fetch_add(1, std::memory_order_relaxed);
+        else
+            dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // from the main thread, waits for room in the ring
+    void send(report_t &&r)
+    {
+        while (!ring.push(std::move(r)))
+            std::this_thread::yield();
+        pushed.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void message(const std::string &text)
+    {
+        report_t r;
+        r.text = text;
+        send(std::move(r));
+    }
+
+    // wait until everything sent so far has been written
+    void flush()
+    {
+        const uint64_t target = pushed.load(std::memory_order_relaxed);
+        while (written.load(std::memory_order_acquire) < target)
+            std::this_thread::yield();
+    }
+};
+
+#endif
@@ -0,0 +1,210 @@
+/*
+ * This file is part of libsidplayfp, a SID player engine.
+ *
+ * Copyright 2023 Leandro Nini <drfiemost@users.sourceforge.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef SENSITIVITY_H
+#define SENSITIVITY_H
+
+#include <cmath>
+#include <cstdint>
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <vector>
+
+#include "parameters.h"
+#include "reference.h"
+#include "random.h"
+#include "refine.h"
+#include "batch.h"
+
+/*
+ * How well the data pins down the fitted parameters, after the fit.
+ *
+ * The local answer is the Hessian of the squared score at the optimum,
+ * by central differences on one batch of candidates, and the covariance
+ * it gives under the usual least squares assumptions. The global one
+ * comes from the bootstrap: the samples are drawn with replacement
+ * and the fit is refined on each replicate, the spread of the refits
+ * gives percentile intervals which also hold away from the optimum.
+ * All the values are in the units of theta, log(q) for the q parameters.
+ *
+ * Both assume the l2 metric: the Hessian is taken of the squared score,
+ * and the refits minimize the sum of the squared residuals.
+ */
+
+// step of the differences, relative to the parameter and at least this
+static const double SENSITIVITY_STEP = 1e-4;
+
+struct sensitivity_t
+{
+    int n = 0;
+    // squared score at the optimum, the sum of the squared weighted residuals with l2
+    double cost = 0.;
+    // of the squared score
+    double hessian[MAX_PARAMS][MAX_PARAMS] = {};
+    // 2*s^2*H^-1 with s^2 = cost/(samples - n), NaN if H is singular
+    double covariance[MAX_PARAMS][MAX_PARAMS] = {};
+};
+
+struct bootstrap_t
+{
+    unsigned int replicates = 0;
+    double level = 0.;
+    double mean[MAX_PARAMS] = {};
+    double stddev[MAX_PARAMS] = {};
+    // percentile interval at the confidence level
+    double lo[MAX_PARAMS] = {};
+    double hi[MAX_PARAMS] = {};
+    double seconds = 0.;
+};
+
+/**
+ * Hessian and covariance of the parameters at the optimum.
+ */
+inline sensitivity_t Sensitivity(const Reference &reference, const Parameters &params)
+{
+    sensitivity_t s;
+    const int N = params.size();
+    s.n = N;
+
+    double h[MAX_PARAMS];
+    for (int i = 0; i < N; i++)
+        h[i] = SENSITIVITY_STEP * std::max(std::abs(params.theta[i]), 1.);
+
+    // the center, the steps either way along each parameter
+    // and the four corners of each pair
+    std::vector<Parameters> stencil(1, params);
+    auto add = [&](int i, double di, int j, double dj) {
+        Parameters p = params;
+        p.theta[i] += di;
+        if (j >= 0)
+            p.theta[j] += dj;
+        stencil.push_back(p);
+    };
+    for (int i = 0; i < N; i++)
+    {
+        add(i, h[i], -1, 0.);
+        add(i, -h[i], -1, 0.);
+    }
+    for (int i = 0; i < N; i++)
+    {
+        for (int j = i + 1; j < N; j++)
+        {
+            add(i, h[i], j, h[j]);
+            add(i, h[i], j, -h[j]);
+            add(i, -h[i], j, h[j]);
+            add(i, -h[i], j, -h[j]);
+        }
+    }
+
+    std::vector<score_t> scores(stencil.size());
+    ScoreBatch(reference, stencil.data(), scores.data(), stencil.size(), std::numeric_limits<double>::infinity());
+    auto f = [&scores](size_t k) { return scores[k].error * scores[k].error; };
+
+    s.cost = f(0);
+    size_t k = 1;
+    for (int i = 0; i < N; i++, k += 2)
+        s.hessian[i][i] = (f(k) - 2. * s.cost + f(k + 1)) / (h[i] * h[i]);
+    for (int i = 0; i < N; i++)
+    {
+        for (int j = i + 1; j < N; j++, k += 4)
+            s.hessian[i][j] = s.hessian[j][i] = (f(k) - f(k + 1) - f(k + 2) + f(k + 3)) / (4. * h[i] * h[j]);
+    }
+
+    // column by column of the inverse
+    const double s2 = reference.size() > static_cast<size_t>(N) ? s.cost / (reference.size() - N) : std::numeric_limits<double>::quiet_NaN();
+    for (int c = 0; c < N; c++)
+    {
+        double A[MAX_PARAMS][MAX_PARAMS];
+        double y[MAX_PARAMS] = {};
+        double x[MAX_PARAMS];
+        std::copy(&s.hessian[0][0], &s.hessian[0][0] + MAX_PARAMS * MAX_PARAMS, &A[0][0]);
+        y[c] = 1.;
+        const bool solved = Solve(A, y, x, N);
+        for (int r = 0; r < N; r++)
+            s.covariance[r][c] = solved ? 2. * s2 * x[r] : std::numeric_limits<double>::quiet_NaN();
+    }
+    return s;
+}
+
+/**
+ * Bootstrap of the fit: each replicate draws as many samples as
+ * there are, with replacement, and refines params on them.
+ * Replicate k uses stream k+1 of the seed, so the result
+ * doesn't depend on the number of threads.
+ */
+inline bootstrap_t Bootstrap(const Reference &reference, const Parameters &params, unsigned int replicates, double level, uint64_t seed, unsigned int threads)
+{
+    const auto start = std::chrono::steady_clock::now();
+    const size_t n = reference.size();
+    const int N = params.size();
+
+    // one replicate and one set of counts per worker, reused
+    const unsigned int workers = ParallelWorkers(threads, replicates);
+    std::vector<Reference> replicas(workers, reference);
+    std::vector<std::vector<unsigned int>> counts(workers, std::vector<unsigned int>(n));
+
+    std::vector<Parameters> fits(replicates, params);
+    RunParallel(workers, replicates, [&](unsigned int w, size_t k) {
+        Rng rng(0);
+        rng.seed(seed, k + 1);
+        std::vector<unsigned int> &c = counts[w];
+        std::fill(c.begin(), c.end(), 0);
+        for (size_t i = 0; i < n; i++)
+            c[std::min<size_t>(static_cast<size_t>((rng.next() >> 11) * 0x1.0p-53 * n), n - 1)]++;
+
+        replicas[w].resample(reference, c.data());
+        Refine(replicas[w], fits[k]);
+    });
+
+    bootstrap_t b;
+    b.replicates = replicates;
+    b.level = level;
+    std::vector<double> values(replicates);
+    for (int i = 0; i < N && replicates; i++)
+    {
+        double sum = 0.;
+        for (unsigned int k = 0; k < replicates; k++)
+            sum += values[k] = fits[k].theta[i];
+        b.mean[i] = sum / replicates;
+
+        double ss = 0.;
+        for (double v: values)
+            ss += (v - b.mean[i]) * (v - b.mean[i]);
+        b.stddev[i] = replicates > 1 ? std::sqrt(ss / (replicates - 1)) : 0.;
+
+        // linear interpolation between the order statistics
+        std::sort(values.begin(), values.end());
+        auto quantile = [&values](double p) {
+            const double x = p * (values.size() - 1);
+            const size_t j = std::min<size_t>(static_cast<size_t>(x), values.size() - 1);
+            const size_t j1 = std::min(j + 1, values.size() - 1);
+            return values[j] + (x - j) * (values[j1] - values[j]);
+        };
+        b.lo[i] = quantile(0.5 * (1. - level));
+        b.hi[i] = quantile(0.5 * (1. + level));
+    }
+
+    b.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return b;
+}
+
+#endif
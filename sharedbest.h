@@ -0,0 +1,136 @@
+/*
+ * This file is part of libsidplayfp, a SID player engine.
+ *
+ * Copyright 2023 Leandro Nini <drfiemost@users.sourceforge.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef SHAREDBEST_H
+#define SHAREDBEST_H
+
+#include <atomic>
+
+#include "parameters.h"
+
+/**
+ * Best parameters/score pair shared between the optimizer threads.
+ *
+ * This is a seqlock: readers never block and never write to the
+ * shared cache line, they just retry if a writer was active in the
+ * meantime. Writers are serialized by the sequence counter itself,
+ * which is odd while an update is in progress.
+ * Workers are expected to poll version() on every trial and only
+ * call read() when it has changed, which happens rarely.
+ */
+class SharedBest
+{
+private:
+    alignas(64) std::atomic<unsigned int> seq;
+    std::atomic<double> error;
+    std::atomic<double> theta[MAX_PARAMS];
+    // fixed for the run, all the candidates use the same transfer function
+    const Transfer_t transfer;
+    const int n;
+
+private:
+    static void cpuRelax()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+
+public:
+    SharedBest(const Parameters &params, const score_t &score) :
+        seq(0),
+        error(score.error),
+        transfer(params.transfer),
+        n(params.size())
+    {
+        for (int i = 0; i < MAX_PARAMS; i++)
+            theta[i].store(params.theta[i], std::memory_order_relaxed);
+    }
+
+    unsigned int version() const { return seq.load(std::memory_order_acquire); }
+
+    /**
+     * Get a consistent snapshot of the current best.
+     *
+     * @return the version of the snapshot
+     */
+    unsigned int read(Parameters &params, score_t &score) const
+    {
+        for (;;)
+        {
+            const unsigned int s = seq.load(std::memory_order_acquire);
+            if (s & 1)
+            {
+                cpuRelax();
+                continue;
+            }
+
+            score.error = error.load(std::memory_order_relaxed);
+            params.transfer = transfer;
+            for (int i = 0; i < n; i++)
+                params.theta[i] = theta[i].load(std::memory_order_relaxed);
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (seq.load(std::memory_order_relaxed) == s)
+                return s;
+        }
+    }
+
+    /**
+     * Publish a new candidate if it beats the current best,
+     * or if it scores the same and acceptEqual is set.
+     *
+     * @return true if the candidate has been stored
+     */
+    bool publish(const Parameters &params, const score_t &score, bool acceptEqual)
+    {
+        unsigned int s = seq.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            if (s & 1)
+            {
+                cpuRelax();
+                s = seq.load(std::memory_order_relaxed);
+                continue;
+            }
+            if (seq.compare_exchange_weak(s, s + 1, std::memory_order_acquire, std::memory_order_relaxed))
+                break;
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+
+        const double current = error.load(std::memory_order_relaxed);
+        const bool accept = (score.error < current) || (acceptEqual && score.error == current);
+        if (!accept)
+        {
+            // nothing has been written, restore the old version
+            seq.store(s, std::memory_order_release);
+            return false;
+        }
+
+        error.store(score.error, std::memory_order_relaxed);
+        for (int i = 0; i < n; i++)
+            theta[i].store(params.theta[i], std::memory_order_relaxed);
+
+        seq.store(s + 2, std::memory_order_release);
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,298 @@
+/*
+ * This file is part of libsidplayfp, a SID player engine.
+ *
+ * Copyright 2023 Leandro Nini <drfiemost@users.sourceforge.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef SPLINE_H
+#define SPLINE_H
+
+#include <cmath>
+#include <cctype>
+
+#include <array>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <limits>
+#include <algorithm>
+
+#include "parameters.h"
+#include "reference.h"
+
+/**
+ * Piecewise cubic approximation of the fitted transfer function.
+ *
+ * Each segment is the cubic Hermite interpolant of the curve, using
+ * the exact values at the segment ends and the derivatives limited as
+ * by Fritsch and Carlson, so that each segment is monotone like the
+ * curve between its ends; the tangents are shared by the neighbouring
+ * segments, so the approximation is C1 continuous. Segments are bisected
+ * until the error on each of them is within the target, which
+ * concentrates them around the steep part of the curve and keeps
+ * the table small.
+ *
+ * Vout = c0 + c1*t + c2*t^2 + c3*t^3, t = Vin - x[i]
+ */
+struct spline_t
+{
+    double Vmin;
+    double Vmax;
+    // segment start points, plus the end of the last one
+    std::vector<double> x;
+    std::vector<std::array<double, 4>> c;
+    double maxError;
+};
+
+// samples per segment used to estimate the error while subdividing
+static const int SPLINE_SAMPLES = 32;
+
+// the spline is verified on this many points over the whole range
+static const int SPLINE_VERIFY = 1 << 20;
+
+inline double CurveValue(const Parameters &params, const Reference &reference, double Vin, double* derivative = nullptr)
+{
+    const double range = reference.getVmax() - reference.getVmin();
+    double dg;
+    const double g = params.GetNormalized(Vin - reference.getVmin(), derivative ? &dg : nullptr);
+    if (derivative)
+        *derivative = range * dg;
+    return reference.getVmin() + range * g;
+}
+
+inline double EvaluateSpline(const spline_t &spline, double Vin)
+{
+    Vin = std::min(std::max(Vin, spline.Vmin), spline.Vmax);
+    const size_t n = spline.c.size();
+    const size_t i = std::min<size_t>(std::upper_bound(spline.x.begin(), spline.x.end(), Vin) - spline.x.begin(), n) - 1;
+    const double t = Vin - spline.x[i];
+    const std::array<double, 4> &c = spline.c[i];
+    return ((c[3]*t + c[2])*t + c[1])*t + c[0];
+}
+
+/**
+ * Fritsch-Carlson limiting of the tangents m at the knots x of the
+ * values f: a tangent is zero where the secants on either side have
+ * different signs or are flat, and the tangents of each segment are
+ * scaled down to alpha^2 + beta^2 <= 9, alpha and beta the tangents
+ * relative to the secant, which makes the Hermite cubic monotone.
+ * A tangent is scaled by the smaller factor of its two segments.
+ */
+inline void MonotoneTangents(const std::vector<double> &x, const std::vector<double> &f, std::vector<double> &m)
+{
+    const size_t n = x.size();
+    std::vector<double> scale(n, 1.);
+    for (size_t i = 0; i + 1 < n; i++)
+    {
+        const double slope = (f[i + 1] - f[i]) / (x[i + 1] - x[i]);
+        if (slope == 0. || m[i] * slope < 0.)
+            m[i] = 0.;
+        if (slope == 0. || m[i + 1] * slope < 0.)
+            m[i + 1] = 0.;
+        if (slope == 0.)
+            continue;
+
+        const double alpha = m[i] / slope;
+        const double beta = m[i + 1] / slope;
+        const double r2 = alpha * alpha + beta * beta;
+        if (r2 > 9.)
+        {
+            const double tau = 3. / std::sqrt(r2);
+            scale[i] = std::min(scale[i], tau);
+            scale[i + 1] = std::min(scale[i + 1], tau);
+        }
+    }
+    for (size_t i = 0; i < n; i++)
+        m[i] *= scale[i];
+}
+
+inline std::array<double, 4> HermiteSegment(double a, double b, double fa, double fb, double da, double db)
+{
+    const double h = b - a;
+    const double slope = (fb - fa) / h;
+
+    std::array<double, 4> c;
+    c[0] = fa;
+    c[1] = da;
+    c[2] = (3.*slope - 2.*da - db) / h;
+    c[3] = (da + db - 2.*slope) / (h*h);
+    return c;
+}
+
+// segment [a, b) on its own, limited as if it were the whole spline
+inline std::array<double, 4> HermiteSegment(const Parameters &params, const Reference &reference, double a, double b)
+{
+    const std::vector<double> x = { a, b };
+    std::vector<double> f(2), m(2);
+    f[0] = CurveValue(params, reference, a, &m[0]);
+    f[1] = CurveValue(params, reference, b, &m[1]);
+    MonotoneTangents(x, f, m);
+    return HermiteSegment(a, b, f[0], f[1], m[0], m[1]);
+}
+
+inline double SegmentError(const Parameters &params, const Reference &reference, double a, double b, const std::array<double, 4> &c)
+{
+    double error = 0.;
+    for (int k = 1; k < SPLINE_SAMPLES; k++)
+    {
+        const double t = (b - a) * k / SPLINE_SAMPLES;
+        const double approx = ((c[3]*t + c[2])*t + c[1])*t + c[0];
+        error = std::max(error, std::abs(approx - CurveValue(params, reference, a + t, nullptr)));
+    }
+    return error;
+}
+
+/**
+ * Build a spline whose max absolute error in volts is below target.
+ *
+ * @return false if the target can't be reached, with the reason in error
+ */
+inline bool BuildSpline(const Parameters &params, const Reference &reference, double target, spline_t &spline, std::string &error)
+{
+    spline = spline_t();
+    spline.Vmin = reference.getVmin();
+    spline.Vmax = reference.getVmax();
+
+    // segments still to be checked, as [a, b) pairs
+    std::vector<std::pair<double, double>> todo;
+    todo.push_back(std::make_pair(spline.Vmin, spline.Vmax));
+
+    // the rounding of the cubics, no spline does better
+    const double resolution = 16. * std::numeric_limits<double>::epsilon() * std::max(std::abs(spline.Vmin), std::abs(spline.Vmax));
+    if (!(target > resolution))
+    {
+        std::ostringstream os;
+        os << "the target of " << target << " V is below the resolution of " << resolution << " V";
+        error = os.str();
+        return false;
+    }
+
+    // shortest segment, below this we give up on the target
+    const double minWidth = (spline.Vmax - spline.Vmin) * 1e-9;
+
+    // sample-based tolerance, tightened if the final check fails
+    double tolerance = target;
+    for (;;)
+    {
+        std::vector<std::pair<double, double>> segments;
+        while (!todo.empty())
+        {
+            const std::pair<double, double> s = todo.back();
+            todo.pop_back();
+
+            const std::array<double, 4> c = HermiteSegment(params, reference, s.first, s.second);
+            if (SegmentError(params, reference, s.first, s.second, c) > tolerance)
+            {
+                if ((s.second - s.first) <= minWidth)
+                {
+                    std::ostringstream os;
+                    os << "no segment of the minimum width " << minWidth << " V around " << s.first << " V meets the target of " << target << " V";
+                    error = os.str();
+                    return false;
+                }
+                const double mid = 0.5 * (s.first + s.second);
+                todo.push_back(std::make_pair(mid, s.second));
+                todo.push_back(std::make_pair(s.first, mid));
+            }
+            else
+            {
+                segments.push_back(s);
+            }
+        }
+
+        std::sort(segments.begin(), segments.end());
+        spline.x.clear();
+        spline.c.clear();
+        for (const std::pair<double, double> &s: segments)
+            spline.x.push_back(s.first);
+        spline.x.push_back(spline.Vmax);
+
+        // the knots are shared, so are their limited tangents
+        std::vector<double> f(spline.x.size()), m(spline.x.size());
+        for (size_t i = 0; i < spline.x.size(); i++)
+            f[i] = CurveValue(params, reference, spline.x[i], &m[i]);
+        MonotoneTangents(spline.x, f, m);
+        for (size_t i = 0; i + 1 < spline.x.size(); i++)
+            spline.c.push_back(HermiteSegment(spline.x[i], spline.x[i + 1], f[i], f[i + 1], m[i], m[i + 1]));
+
+        // verify on a dense grid
+        spline.maxError = 0.;
+        for (int i = 0; i <= SPLINE_VERIFY; i++)
+        {
+            const double Vin = spline.Vmin + (spline.Vmax - spline.Vmin) * i / SPLINE_VERIFY;
+            spline.maxError = std::max(spline.maxError, std::abs(EvaluateSpline(spline, Vin) - CurveValue(params, reference, Vin)));
+        }
+
+        if (spline.maxError <= target)
+            return true;
+        if (tolerance < target * 1e-3)
+        {
+            std::ostringstream os;
+            os << "max error " << spline.maxError << " V above the target of " << target << " V";
+            error = os.str();
+            return false;
+        }
+
+        tolerance *= 0.5;
+        todo = segments;
+    }
+}
+
+/**
+ * Write the spline as a C++ header with constexpr tables
+ * and an inline evaluation function.
+ */
+inline void WriteSplineHeader(std::ostream &os, const spline_t &spline, const Parameters &params, const std::string &name)
+{
+    std::string guard = name;
+    std::transform(guard.begin(), guard.end(), guard.begin(), ::toupper);
+    guard += "_SPLINE_H";
+
+    const size_t n = spline.c.size();
+
+    os.precision(std::numeric_limits<double>::max_digits10);
+    os << "// Generated by opamp, do not edit" << std::endl;
+    os << "//" << std::endl;
+    std::string p = params.toString();
+    for (size_t pos; (pos = p.find('\n')) != std::string::npos; p.erase(0, pos + 1))
+        os << "// " << p.substr(0, pos) << std::endl;
+    os << "// " << n << " segments, max error " << spline.maxError << " V" << std::endl;
+    os << std::endl;
+    os << "#ifndef " << guard << std::endl;
+    os << "#define " << guard << std::endl << std::endl;
+    os << "#include <algorithm>" << std::endl << std::endl;
+    os << "constexpr double " << name << "_spline_x[" << n + 1 << "] =" << std::endl << "{" << std::endl;
+    for (double x: spline.x)
+        os << "    " << x << "," << std::endl;
+    os << "};" << std::endl << std::endl;
+    os << "constexpr double " << name << "_spline_c[" << n << "][4] =" << std::endl << "{" << std::endl;
+    for (const std::array<double, 4> &c: spline.c)
+        os << "    { " << c[0] << ", " << c[1] << ", " << c[2] << ", " << c[3] << " }," << std::endl;
+    os << "};" << std::endl << std::endl;
+    os << "inline double " << name << "_spline(double vin)" << std::endl
+       << "{" << std::endl
+       << "    vin = std::min(std::max(vin, " << spline.Vmin << "), " << spline.Vmax << ");" << std::endl
+       << "    const int i = std::min<int>(std::upper_bound(" << name << "_spline_x, " << name << "_spline_x + " << n + 1 << ", vin) - " << name << "_spline_x, " << n << ") - 1;" << std::endl
+       << "    const double t = vin - " << name << "_spline_x[i];" << std::endl
+       << "    const double* c = " << name << "_spline_c[i];" << std::endl
+       << "    return ((c[3]*t + c[2])*t + c[1])*t + c[0];" << std::endl
+       << "}" << std::endl << std::endl;
+    os << "#endif" << std::endl;
+}
+
+#endif
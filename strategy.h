@@ -0,0 +1,291 @@
+/*
+ * This file is part of libsidplayfp, a SID player engine.
+ *
+ * Copyright 2023 Leandro Nini <drfiemost@users.sourceforge.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef STRATEGY_H
+#define STRATEGY_H
+
+#include <cmath>
+
+#include <array>
+#include <algorithm>
+#include <istream>
+#include <ostream>
+
+#include "parameters.h"
+#include "random.h"
+
+// Mutation strategies
+enum class Strategy_t
+{
+    // constant relative step
+    FIXED,
+    // per parameter steps tuned with the 1/5th success rule
+    ADAPTIVE,
+    // (1+1)-CMA-ES
+    CMAES
+};
+
+// relative step of the fixed strategy and starting step of the others
+static const double INITIAL_STEP = 1e-5;
+
+// bounds of the adapted steps, below the lower one nothing changes anymore
+static const double MIN_STEP = 1e-15;
+static const double MAX_STEP = 0.1;
+
+/**
+ * Per parameter step sizes adapted from the acceptance rate
+ * with Rechenberg's 1/5th success rule: after WINDOW trials involving
+ * a parameter its step grows if more than a fifth of them were
+ * accepted and shrinks otherwise.
+ */
+class StepAdaptation
+{
+private:
+    static const unsigned int WINDOW = 32;
+
+    int n;
+    double steps[MAX_PARAMS];
+    unsigned int trials[MAX_PARAMS];
+    unsigned int successes[MAX_PARAMS];
+
+public:
+    explicit StepAdaptation(int n) :
+        n(n)
+    {
+        for (int i = 0; i < MAX_PARAMS; i++)
+        {
+            steps[i] = INITIAL_STEP;
+            trials[i] = 0;
+            successes[i] = 0;
+        }
+    }
+
+    const double* sigma() const { return steps; }
+
+    void save(std::ostream &os) const
+    {
+        for (int i = 0; i < n; i++)
+            os << steps[i] << " " << trials[i] << " " << successes[i] << " ";
+    }
+
+    bool load(std::istream &is)
+    {
+        for (int i = 0; i < n; i++)
+            is >> steps[i] >> trials[i] >> successes[i];
+        return static_cast<bool>(is);
+    }
+
+    /**
+     * Account for a trial.
+     *
+     * @param mask the parameters that have been changed, bit i for parameter i
+     * @param success the candidate has been accepted
+     */
+    void update(unsigned int mask, bool success)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            if (!(mask & (1u << i)))
+                continue;
+
+            trials[i]++;
+            if (success)
+                successes[i]++;
+
+            if (trials[i] == WINDOW)
+            {
+                const double f = 5 * successes[i] > WINDOW ? 1.22 : 1. / 1.22;
+                steps[i] = std::min(std::max(steps[i] * f, MIN_STEP), MAX_STEP);
+                trials[i] = 0;
+                successes[i] = 0;
+            }
+        }
+    }
+};
+
+/**
+ * (1+1)-CMA-ES with the Cholesky factor update of Igel, Suttorp
+ * and Hansen, "A Computational Efficient Covariance Matrix Update
+ * and a (1+1)-CMA for Evolution Strategies", GECCO 2006.
+ *
+ * The search space is (log(q), log(b), log(v)) so that the steps are
+ * relative, as with the other strategies; parameters which can be zero
+ * or negative, like the asymptotes, are searched on their value.
+ * The covariance picks up the strong correlation between log(q) and b
+ * which makes the plain per parameter steps inefficient close to
+ * the optimum.
+ */
+class Cmaes
+{
+private:
+    static constexpr int M = MAX_PARAMS;
+    static constexpr double P_TARGET = 2. / 11.;
+    static constexpr double C_P = 1. / 12.;
+    static constexpr double P_THRESH = 0.44;
+
+    // dimension and the constants depending on it
+    const int N;
+    const double D;
+    const double C_C;
+    const double C_COV;
+
+    double sigma;
+    double psucc;
+    double pc[M];
+    // Cholesky factor of the covariance and its inverse
+    double A[M][M];
+    double Ainv[M][M];
+
+private:
+    /**
+     * Rank one update of the Cholesky factor so that
+     * C' = alpha*C + beta*pc*pc'.
+     */
+    void updateCholesky(double alpha, double beta)
+    {
+        double w[M];
+        double ww = 0.;
+        for (int i = 0; i < N; i++)
+        {
+            w[i] = 0.;
+            for (int j = 0; j < N; j++)
+                w[i] += Ainv[i][j] * pc[j];
+            ww += w[i] * w[i];
+        }
+        if (!(ww > 0.))
+            return;
+
+        const double a = std::sqrt(alpha);
+        const double r = std::sqrt(1. + beta / alpha * ww);
+        const double fa = a / ww * (r - 1.);
+        const double fi = 1. / (a * ww) * (1. - 1. / r);
+
+        // w'*Ainv, before Ainv changes
+        double wA[M];
+        for (int j = 0; j < N; j++)
+        {
+            wA[j] = 0.;
+            for (int i = 0; i < N; i++)
+                wA[j] += w[i] * Ainv[i][j];
+        }
+
+        for (int i = 0; i < N; i++)
+        {
+            for (int j = 0; j < N; j++)
+            {
+                A[i][j] = a * A[i][j] + fa * pc[i] * w[j];
+                Ainv[i][j] = Ainv[i][j] / a - fi * w[i] * wA[j];
+            }
+        }
+    }
+
+public:
+    explicit Cmaes(int n) :
+        N(n),
+        D(1. + n / 2.),
+        C_C(2. / (n + 2.)),
+        C_COV(2. / (n*n + 6.)),
+        sigma(INITIAL_STEP),
+        psucc(P_TARGET)
+    {
+        for (int i = 0; i < N; i++)
+        {
+            pc[i] = 0.;
+            for (int j = 0; j < N; j++)
+                A[i][j] = Ainv[i][j] = i == j ? 1. : 0.;
+        }
+    }
+
+    double stepSize() const { return sigma; }
+
+    void save(std::ostream &os) const
+    {
+        os << sigma << " " << psucc;
+        for (int i = 0; i < N; i++)
+            os << " " << pc[i];
+        for (int i = 0; i < N; i++)
+            for (int j = 0; j < N; j++)
+                os << " " << A[i][j] << " " << Ainv[i][j];
+    }
+
+    bool load(std::istream &is)
+    {
+        is >> sigma >> psucc;
+        for (int i = 0; i < N; i++)
+            is >> pc[i];
+        for (int i = 0; i < N; i++)
+            for (int j = 0; j < N; j++)
+                is >> A[i][j] >> Ainv[i][j];
+        return static_cast<bool>(is);
+    }
+
+    /**
+     * Draw an offspring of the base parameters.
+     *
+     * @param step receives A*z, needed by update()
+     */
+    void sample(Rng &rng, const Parameters &base, Parameters &p, std::array<double, MAX_PARAMS> &step) const
+    {
+        double z[M];
+        for (int i = 0; i < N; i++)
+            z[i] = GetGaussian(rng);
+        for (int i = 0; i < N; i++)
+        {
+            step[i] = 0.;
+            for (int j = 0; j < N; j++)
+                step[i] += A[i][j] * z[j];
+        }
+
+        p = base;
+        for (int i = 0; i < N; i++)
+            p.SetLogValue(i, base.GetLogValue(i) + sigma * step[i]);
+    }
+
+    /**
+     * Adapt step size and covariance after a generation.
+     *
+     * @param success the offspring has been accepted
+     * @param step the step of the offspring, as returned by sample()
+     */
+    void update(bool success, const std::array<double, MAX_PARAMS> &step)
+    {
+        psucc = (1. - C_P) * psucc + C_P * (success ? 1. : 0.);
+        sigma *= std::exp((psucc - P_TARGET) / (D * (1. - P_TARGET)));
+        sigma = std::min(std::max(sigma, MIN_STEP), MAX_STEP);
+
+        if (!success)
+            return;
+
+        if (psucc < P_THRESH)
+        {
+            for (int i = 0; i < N; i++)
+                pc[i] = (1. - C_C) * pc[i] + std::sqrt(C_C * (2. - C_C)) * step[i];
+            updateCholesky(1. - C_COV, C_COV);
+        }
+        else
+        {
+            for (int i = 0; i < N; i++)
+                pc[i] = (1. - C_C) * pc[i];
+            updateCholesky(1. - C_COV + C_COV * C_C * (2. - C_C), C_COV);
+        }
+    }
+};
+
+#endif
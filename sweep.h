@@ -0,0 +1,433 @@
+/*
+ * This file is part of libsidplayfp, a SID player engine.
+ *
+ * Copyright 2023 Leandro Nini <drfiemost@users.sourceforge.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <utility>
+#include <limits>
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <system_error>
+
+#ifdef _OPENMP
+#  include <omp.h>
+#endif
+
+#include "parameters.h"
+#include "reference.h"
+#include "random.h"
+#include "optimizer.h"
+#include "refine.h"
+#include "device.h"
+
+/*
+ * Sweeps of many candidates on the batched scorer.
+ *
+ * The global sweep finds a starting point from the bounds of log(q),
+ * b and v alone, so that new chips don't need hand tuned parameters:
+ * a coarse grid or Latin hypercube over the bounds is scored, then
+ * the neighbourhood of each of the best cells is sampled again
+ * at a finer scale, level after level, and the best points are
+ * polished with Refine(). The result is cached per dataset.
+ */
+
+// candidates per ScoreBatch() call of the host sweeps
+static const size_t SWEEP_CHUNK = 1024;
+
+// seed of the Latin hypercubes, fixed so that the sweeps can be cached
+static const uint64_t SWEEP_SEED = 0x6581;
+
+static const unsigned int SWEEP_CACHE_VERSION = 1;
+
+typedef std::pair<double, uint64_t> ranked_t;
+
+// best first, ties by index so the result doesn't depend on the threads
+inline void KeepBest(std::vector<ranked_t> &ranked, size_t topk)
+{
+    const size_t keep = std::min(topk, ranked.size());
+    std::partial_sort(ranked.begin(), ranked.begin() + keep, ranked.end());
+    ranked.resize(keep);
+}
+
+/**
+ * Score count candidates, built by at(index), on the threads of the
+ * executor or else on the OpenMP threads, and return the topk best
+ * ones, best first.
+ *
+ * Each thread keeps its own best list and scores its chunks with
+ * the worst of them as bound, so most candidates are abandoned
+ * after the first samples; a candidate of the overall best is among
+ * the best of its thread, so its score is always the complete one.
+ */
+template<typename F>
+inline std::vector<candidate_t> BatchSweep(const Reference &reference, uint64_t count, size_t topk, unsigned int threads, const executor_t &executor, F at)
+{
+    std::vector<std::vector<ranked_t>> best(threads);
+    const int64_t chunks = static_cast<int64_t>((count + SWEEP_CHUNK - 1) / SWEEP_CHUNK);
+
+    // chunk c into the best list of a thread
+    auto sweep = [&](int64_t c, std::vector<ranked_t> &mine, std::vector<Parameters> &candidates, std::vector<score_t> &scores) {
+        const uint64_t first = static_cast<uint64_t>(c) * SWEEP_CHUNK;
+        const size_t K = static_cast<size_t>(std::min<uint64_t>(SWEEP_CHUNK, count - first));
+        for (size_t k = 0; k < K; k++)
+            candidates[k] = at(first + k);
+
+        const double worst = mine.size() < topk ? std::numeric_limits<double>::infinity() : mine.back().first;
+        ScoreBatch(reference, candidates.data(), scores.data(), K, worst);
+        for (size_t k = 0; k < K; k++)
+        {
+            // NaNs never get in
+            if (scores[k].error < worst)
+                mine.emplace_back(scores[k].error, first + k);
+        }
+        KeepBest(mine, topk);
+    };
+
+    if (executor)
+    {
+        // the chunks are handed out in order as the threads get free
+        std::atomic<int64_t> next(0);
+        executor(threads, [&](unsigned int t) {
+            std::vector<Parameters> candidates(SWEEP_CHUNK);
+            std::vector<score_t> scores(SWEEP_CHUNK);
+            const simd::FlushDenormals ftz;
+
+            for (int64_t c = next++; c < chunks; c = next++)
+                sweep(c, best[t], candidates, scores);
+        });
+    }
+    else
+    {
+#ifdef _OPENMP
+#   pragma omp parallel num_threads(threads)
+#endif
+        {
+#ifdef _OPENMP
+            std::vector<ranked_t> &mine = best[omp_get_thread_num()];
+#else
+            std::vector<ranked_t> &mine = best[0];
+#endif
+            std::vector<Parameters> candidates(SWEEP_CHUNK);
+            std::vector<score_t> scores(SWEEP_CHUNK);
+            const simd::FlushDenormals ftz;
+
+#ifdef _OPENMP
+#   pragma omp for schedule(dynamic)
+#endif
+            for (int64_t c = 0; c < chunks; c++)
+                sweep(c, mine, candidates, scores);
+        }
+    }
+
+    std::vector<ranked_t> all;
+    for (const std::vector<ranked_t> &b: best)
+        all.insert(all.end(), b.begin(), b.end());
+    KeepBest(all, topk);
+
+    std::vector<candidate_t> result(all.size());
+    for (size_t i = 0; i < all.size(); i++)
+    {
+        result[i].params = at(all[i].second);
+        result[i].score.error = all[i].first;
+    }
+    return result;
+}
+
+/**
+ * Score every point of the grid, on the device if there is one
+ * and on the batched scorer otherwise.
+ */
+inline std::vector<candidate_t> Sweep(const Reference &reference, const grid_t &grid, size_t topk, unsigned int threads, const executor_t &executor)
+{
+#ifdef _OPENMP
+    // the device kernel only knows the squared error
+    if (omp_get_num_devices() > 0 && reference.getMetric() == Metric_t::L2)
+        return DeviceSweep(reference, grid, topk);
+#endif
+    return BatchSweep(reference, grid.size(), topk, threads, executor, [&grid](uint64_t i) { return grid.at(i); });
+}
+
+// Where Sweep() runs
+inline std::string SweepDevice([[maybe_unused]] const Reference &reference)
+{
+#ifdef _OPENMP
+    if (omp_get_num_devices() > 0 && reference.getMetric() == Metric_t::L2)
+        return DeviceName();
+#endif
+    return "host";
+}
+
+// logistic parameters at (log(q), log(b), log(v))
+inline Parameters LogisticAt(const double* c)
+{
+    Parameters p;
+    p.theta[Logistic::Q] = c[0];
+    p.theta[Logistic::B] = std::exp(c[1]);
+    p.theta[Logistic::V] = std::exp(c[2]);
+    return p;
+}
+
+/**
+ * Sample the box center +- half of the logistic search coordinates
+ * with about n points, on a grid with the cells centered in the box
+ * or on a Latin hypercube.
+ *
+ * @param cell filled with the spacing of the samples on each axis
+ */
+inline std::vector<candidate_t> SampleBox(const Reference &reference, const config_t &config, const double* center, const double* half,
+    uint64_t n, size_t topk, uint64_t seed, unsigned int threads, const executor_t &executor, double* cell)
+{
+    if (!config.lhs)
+    {
+        const uint64_t m = std::max<uint64_t>(2, static_cast<uint64_t>(std::cbrt(static_cast<double>(n)) + 1e-9));
+        grid_t grid(LogisticAt(center));
+        for (int a = 0; a < Logistic::N; a++)
+        {
+            cell[a] = 2. * half[a] / m;
+            grid.lo[a] = center[a] - half[a] + 0.5 * cell[a];
+            grid.hi[a] = center[a] + half[a] - 0.5 * cell[a];
+            grid.points[a] = m;
+        }
+        return Sweep(reference, grid, topk, threads, executor);
+    }
+
+    // each axis is split in n strata, sample i takes the stratum
+    // perm[a][i] with a random offset in it
+    std::vector<double> coordinates(n * Logistic::N);
+    uint64_t state = seed;
+    for (int a = 0; a < Logistic::N; a++)
+    {
+        std::vector<uint64_t> perm(n);
+        for (uint64_t i = 0; i < n; i++)
+            perm[i] = i;
+        for (uint64_t i = n - 1; i > 0; i--)
+            std::swap(perm[i], perm[SplitMix64(state) % (i + 1)]);
+
+        const double width = 2. * half[a] / n;
+        for (uint64_t i = 0; i < n; i++)
+        {
+            const double u = (SplitMix64(state) >> 11) * 0x1.0p-53;
+            coordinates[i * Logistic::N + a] = center[a] - half[a] + (perm[i] + u) * width;
+        }
+        // same resolution as a grid of n points
+        cell[a] = 2. * half[a] / std::cbrt(static_cast<double>(n));
+    }
+    return BatchSweep(reference, n, topk, threads, executor, [&coordinates](uint64_t i) { return LogisticAt(&coordinates[i * Logistic::N]); });
+}
+
+/**
+ * Coarse-to-fine sweep over config.bounds for logistic starting points.
+ *
+ * The first level spreads config.sweepPoints samples over the bounds,
+ * each of the next config.sweepLevels - 1 levels samples a box two cells
+ * wide around each of the config.sweepTop best points with a share of
+ * them, the best points carry over from level to level.
+ * The final ones are refined if config.refine is set.
+ *
+ * @param scored filled with the number of candidates scored
+ * @return the best points, best first
+ */
+inline std::vector<candidate_t> GlobalSweep(const Reference &reference, const config_t &config, unsigned int threads, const executor_t &executor, uint64_t &scored)
+{
+    const size_t topk = config.sweepTop;
+    const double* bounds = config.bounds;
+
+    // b and v are sampled on their logarithm
+    double center[Logistic::N];
+    double half[Logistic::N];
+    for (int a = 0; a < Logistic::N; a++)
+    {
+        const double lo = a == 0 ? bounds[0] : std::log(bounds[2 * a]);
+        const double hi = a == 0 ? bounds[1] : std::log(bounds[2 * a + 1]);
+        center[a] = 0.5 * (lo + hi);
+        half[a] = 0.5 * (hi - lo);
+    }
+
+    double cell[Logistic::N];
+    std::vector<candidate_t> best = SampleBox(reference, config, center, half, config.sweepPoints, topk, SWEEP_SEED, threads, executor, cell);
+    scored = config.sweepPoints;
+
+    const uint64_t share = std::max<uint64_t>(8, config.sweepPoints / std::max<size_t>(1, best.size()));
+    for (unsigned int level = 1; level < config.sweepLevels && !best.empty(); level++)
+    {
+        for (int a = 0; a < Logistic::N; a++)
+            half[a] = cell[a];
+
+        std::vector<candidate_t> next = best;
+        for (size_t i = 0; i < best.size(); i++)
+        {
+            const Parameters &p = best[i].params;
+            const double c[Logistic::N] = { p.GetLogValue(Logistic::Q), p.GetLogValue(Logistic::B), p.GetLogValue(Logistic::V) };
+            const std::vector<candidate_t> found = SampleBox(reference, config, c, half, share, topk, SWEEP_SEED + level * topk + i, threads, executor, cell);
+            for (const candidate_t &f: found)
+            {
+                const bool seen = std::any_of(next.begin(), next.end(), [&f](const candidate_t &n) { return n.params == f.params; });
+                if (!seen)
+                    next.push_back(f);
+            }
+            scored += share;
+        }
+
+        std::stable_sort(next.begin(), next.end(), [](const candidate_t &a, const candidate_t &b) { return b.score.isBetter(a.score); });
+        if (next.size() > topk)
+            next.resize(topk);
+        best = next;
+    }
+
+    if (config.refine)
+    {
+        for (candidate_t &c: best)
+            c.score = Refine(reference, c.params).score;
+        std::stable_sort(best.begin(), best.end(), [](const candidate_t &a, const candidate_t &b) { return b.score.isBetter(a.score); });
+    }
+    return best;
+}
+
+/*
+ * The global sweep cache, a small text file per dataset named after
+ * the hash of the samples, in the same spirit as the checkpoints:
+ *
+ *   opamp-sweep 1
+ *   options <levels> <points> <top> <lhs> <refine> <bounds> <objective>
+ *   candidates <count>
+ *   <logq> <b> <v> <score>                           one per candidate
+ *   end
+ *
+ * A cache entry written with other options is ignored and replaced.
+ */
+
+// $XDG_CACHE_HOME/opamp or ~/.cache/opamp, empty if neither is set
+inline std::string DefaultSweepCache()
+{
+    const char* xdg = std::getenv("XDG_CACHE_HOME");
+    if (xdg && *xdg)
+        return (std::filesystem::path(xdg) / "opamp").string();
+    const char* home = std::getenv("HOME");
+    if (home && *home)
+        return (std::filesystem::path(home) / ".cache" / "opamp").string();
+    return std::string();
+}
+
+inline std::string SweepCacheFile(const config_t &config, const Reference &reference)
+{
+    if (config.sweepCache.empty())
+        return std::string();
+
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.sweep", static_cast<unsigned long long>(reference.hash()));
+    return (std::filesystem::path(config.sweepCache) / name).string();
+}
+
+inline std::string SweepOptions(const config_t &config, const Reference &reference)
+{
+    std::ostringstream os;
+    os.precision(std::numeric_limits<double>::max_digits10);
+    os << "options " << config.sweepLevels << " " << config.sweepPoints << " " << config.sweepTop << " "
+       << config.lhs << " " << config.refine;
+    for (double b: config.bounds)
+        os << " " << b;
+    os << " " << reference.objective();
+    return os.str();
+}
+
+// @return false if there is no usable entry
+inline bool ReadSweepCache(const std::string &file, const config_t &config, const Reference &reference, std::vector<candidate_t> &candidates)
+{
+    std::ifstream is(file);
+    std::string magic, options;
+    unsigned int version;
+    if (!(is >> magic >> version) || magic != "opamp-sweep" || version != SWEEP_CACHE_VERSION)
+        return false;
+    is >> std::ws;
+    if (!std::getline(is, options) || options != SweepOptions(config, reference))
+        return false;
+
+    std::string word;
+    size_t count;
+    // the sweep keeps no more than its top points, a larger count is a corrupt entry
+    if (!(is >> word >> count) || word != "candidates" || count > config.sweepTop)
+        return false;
+
+    std::vector<candidate_t> read(count);
+    for (candidate_t &c: read)
+    {
+        if (!(is >> c.params.theta[Logistic::Q] >> c.params.theta[Logistic::B] >> c.params.theta[Logistic::V] >> c.score.error))
+            return false;
+    }
+    if (!(is >> word) || word != "end" || read.empty())
+        return false;
+
+    candidates = read;
+    return true;
+}
+
+/**
+ * Write the entry to a temporary file of its own and rename it over
+ * the old one, concurrent fits of the same dataset then never see
+ * a partial entry, the last one to finish replaces the others.
+ */
+inline bool WriteSweepCache(const std::string &file, const config_t &config, const Reference &reference, const std::vector<candidate_t> &candidates)
+{
+    std::error_code ec;
+    std::filesystem::create_directories(std::filesystem::path(file).parent_path(), ec);
+
+    // a random name, the writers may be other processes or threads
+    const std::string tmp = file + "." + std::to_string(getSeed()) + ".tmp";
+    {
+        std::ofstream os(tmp);
+        os.precision(std::numeric_limits<double>::max_digits10);
+        os << "opamp-sweep " << SWEEP_CACHE_VERSION << std::endl;
+        os << SweepOptions(config, reference) << std::endl;
+        os << "candidates " << candidates.size() << std::endl;
+        for (const candidate_t &c: candidates)
+        {
+            os << c.params.theta[Logistic::Q] << " " << c.params.theta[Logistic::B] << " "
+               << c.params.theta[Logistic::V] << " " << c.score.error << std::endl;
+        }
+        os << "end" << std::endl;
+        if (!os)
+        {
+            os.close();
+            std::filesystem::remove(tmp, ec);
+            return false;
+        }
+    }
+
+    std::filesystem::rename(tmp, file, ec);
+    if (ec)
+    {
+        std::error_code ignored;
+        std::filesystem::remove(tmp, ignored);
+    }
+    return !ec;
+}
+
+#endif
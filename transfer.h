@@ -0,0 +1,338 @@
+/*
+ * This file is part of libsidplayfp, a SID player engine.
+ *
+ * Copyright 2023 Leandro Nini <drfiemost@users.sourceforge.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <cmath>
+
+#include <algorithm>
+#include <string>
+
+#include "simd.h"
+
+/*
+ * Transfer functions that can be fitted to the data.
+ *
+ * Each one maps the shifted input voltage x = Vin - Vmin to the
+ * normalized output g(x), the output voltage being Vmin + (Vmax-Vmin)*g.
+ * A transfer function is a struct of static members:
+ *
+ *   id, name       identifier and command line name
+ *   N              number of parameters, at most MAX_PARAMS
+ *   names, roles   name and role of each parameter
+ *   cost           evaluation cost relative to the logistic
+ *   C, prepare()   loop invariant constants of a candidate, like 1/v,
+ *                  for inputs optionally shifted by xc
+ *   kernel()       vectorized g(x) from the constants, in double
+ *                  or single precision
+ *   value()        scalar g(x) with its derivatives with respect to
+ *                  x and to the parameters
+ *   fromLogistic() parameters giving the same curve as a logistic
+ *
+ * The scoring loops are templates over the transfer function so
+ * each kernel is inlined and vectorized, WithTransfer() picks the
+ * instance from the runtime id once per call.
+ */
+
+// Transfer functions
+enum class Transfer_t
+{
+    LOGISTIC,
+    RICHARDS,
+    DOUBLE_LOGISTIC
+};
+
+// Role of a parameter, which decides how it is stored and mutated
+enum class Param_t
+{
+    // q, stored as its logarithm and mutated by relative steps of q
+    Q,
+    // b, positive, relative steps
+    B,
+    // v, positive, relative steps
+    V,
+    // asymptotes and weights, may be zero or negative, absolute steps
+    A
+};
+
+static const int MAX_PARAMS = 7;
+
+// the scalar value() functions are also built for the devices, see device.h
+#ifdef _OPENMP
+#   pragma omp declare target
+#endif
+
+/**
+ * log(1+e^t) with its derivative, the logistic sigmoid.
+ */
+inline double Softplus(double t, double* sigmoid)
+{
+    if (sigmoid)
+        *sigmoid = t >= 0. ? 1./(1. + std::exp(-t)) : std::exp(t)/(1. + std::exp(t));
+    return std::max(t, 0.) + std::log1p(std::exp(-std::abs(t)));
+}
+
+#ifdef _OPENMP
+#   pragma omp end declare target
+#endif
+
+/**
+ * Generalised logistic function, normalized:
+ * g = 1/(1+q*e^(b*x))^(1/v) = e^(-log(1+e^(b*x+log(q)))/v)
+ * which also avoids the overflow of e^(b*x) for large b.
+ *
+ * https://en.wikipedia.org/wiki/Generalised_logistic_function
+ */
+struct Logistic
+{
+    enum { Q, B, V };
+
+    static constexpr Transfer_t id = Transfer_t::LOGISTIC;
+    static constexpr const char* name = "logistic";
+    static constexpr int N = 3;
+    static constexpr const char* names[N] = { "logq", "b", "v" };
+    static constexpr Param_t roles[N] = { Param_t::Q, Param_t::B, Param_t::V };
+    static constexpr double cost = 1.;
+
+    static constexpr int C = 3;
+    // b*x + log(q) = b*(x - xc) + (log(q) + b*xc), with xc close to
+    // the steep part of the curve the constant is small and there is
+    // no cancellation, which matters in single precision
+    static void prepare(const double* theta, double* c, double xc = 0.)
+    {
+        c[0] = theta[B];
+        c[1] = theta[Q] + theta[B]*xc;
+        c[2] = 1./theta[V];
+    }
+
+    // all arguments may be either broadcast or per-lane values
+    template<typename V>
+    SIMD_INLINE static V kernel(V x, const V* c)
+    {
+        return simd::exp(simd::softplus(simd::fma(x, c[0], c[1])) * (V(0.f) - c[2]));
+    }
+
+#ifdef _OPENMP
+#   pragma omp declare target
+#endif
+    static double value(const double* theta, double x, double* dx, double* grad)
+    {
+        const double t = theta[B]*x + theta[Q];
+        double sigmoid;
+        const double s = Softplus(t, &sigmoid);
+        const double v = theta[V];
+        const double g = std::exp(-s/v);
+        if (dx)
+            *dx = -g*sigmoid*theta[B]/v;
+        if (grad)
+        {
+            grad[Q] = -g*sigmoid/v;
+            grad[B] = -g*sigmoid*x/v;
+            grad[V] = g*s/(v*v);
+        }
+        return g;
+    }
+#ifdef _OPENMP
+#   pragma omp end declare target
+#endif
+
+    static void fromLogistic(const double* logistic, double* theta)
+    {
+        std::copy(logistic, logistic + N, theta);
+    }
+};
+
+/**
+ * Richards curve with free asymptotes:
+ * g = lo + (hi-lo)/(1+q*e^(b*x))^(1/v)
+ * for data which does not quite reach the ends of the range.
+ */
+struct Richards
+{
+    enum { LO, HI, Q, B, V };
+
+    static constexpr Transfer_t id = Transfer_t::RICHARDS;
+    static constexpr const char* name = "richards";
+    static constexpr int N = 5;
+    static constexpr const char* names[N] = { "lo", "hi", "logq", "b", "v" };
+    static constexpr Param_t roles[N] = { Param_t::A, Param_t::A, Param_t::Q, Param_t::B, Param_t::V };
+    static constexpr double cost = 1.;
+
+    static constexpr int C = 5;
+    static void prepare(const double* theta, double* c, double xc = 0.)
+    {
+        Logistic::prepare(theta + Q, c, xc);
+        c[3] = theta[LO];
+        c[4] = theta[HI] - theta[LO];
+    }
+
+    template<typename V>
+    SIMD_INLINE static V kernel(V x, const V* c)
+    {
+        return simd::fma(Logistic::kernel(x, c), c[4], c[3]);
+    }
+
+#ifdef _OPENMP
+#   pragma omp declare target
+#endif
+    static double value(const double* theta, double x, double* dx, double* grad)
+    {
+        const double range = theta[HI] - theta[LO];
+        const double l = Logistic::value(theta + Q, x, dx, grad ? grad + Q : nullptr);
+        if (dx)
+            *dx *= range;
+        if (grad)
+        {
+            for (int i = Q; i < N; i++)
+                grad[i] *= range;
+            grad[LO] = 1. - l;
+            grad[HI] = l;
+        }
+        return theta[LO] + range*l;
+    }
+#ifdef _OPENMP
+#   pragma omp end declare target
+#endif
+
+    static void fromLogistic(const double* logistic, double* theta)
+    {
+        theta[LO] = 0.;
+        theta[HI] = 1.;
+        std::copy(logistic, logistic + Logistic::N, theta + Q);
+    }
+};
+
+/**
+ * Weighted sum of two logistics:
+ * g = w*g1(x) + (1-w)*g2(x)
+ * which can follow a change of curvature like the one
+ * of the 6581 around 4.90 V.
+ */
+struct DoubleLogistic
+{
+    enum { Q1, B1, V1, Q2, B2, V2, W };
+
+    static constexpr Transfer_t id = Transfer_t::DOUBLE_LOGISTIC;
+    static constexpr const char* name = "double";
+    static constexpr int N = 7;
+    static constexpr const char* names[N] = { "logq1", "b1", "v1", "logq2", "b2", "v2", "w" };
+    static constexpr Param_t roles[N] = { Param_t::Q, Param_t::B, Param_t::V, Param_t::Q, Param_t::B, Param_t::V, Param_t::A };
+    static constexpr double cost = 2.;
+
+    static constexpr int C = 7;
+    static void prepare(const double* theta, double* c, double xc = 0.)
+    {
+        Logistic::prepare(theta + Q1, c, xc);
+        Logistic::prepare(theta + Q2, c + 3, xc);
+        c[6] = theta[W];
+    }
+
+    template<typename V>
+    SIMD_INLINE static V kernel(V x, const V* c)
+    {
+        const V g2 = Logistic::kernel(x, c + 3);
+        return simd::fma(Logistic::kernel(x, c) - g2, c[6], g2);
+    }
+
+#ifdef _OPENMP
+#   pragma omp declare target
+#endif
+    static double value(const double* theta, double x, double* dx, double* grad)
+    {
+        const double w = theta[W];
+        double dx1, dx2;
+        const double g1 = Logistic::value(theta + Q1, x, dx ? &dx1 : nullptr, grad ? grad + Q1 : nullptr);
+        const double g2 = Logistic::value(theta + Q2, x, dx ? &dx2 : nullptr, grad ? grad + Q2 : nullptr);
+        if (dx)
+            *dx = w*dx1 + (1. - w)*dx2;
+        if (grad)
+        {
+            for (int i = Q1; i < Q2; i++)
+                grad[i] *= w;
+            for (int i = Q2; i < W; i++)
+                grad[i] *= 1. - w;
+            grad[W] = g1 - g2;
+        }
+        return w*g1 + (1. - w)*g2;
+    }
+#ifdef _OPENMP
+#   pragma omp end declare target
+#endif
+
+    // all the weight on the first component, the second one
+    // is a flatter copy so that the weight has a gradient
+    static void fromLogistic(const double* logistic, double* theta)
+    {
+        std::copy(logistic, logistic + Logistic::N, theta + Q1);
+        std::copy(logistic, logistic + Logistic::N, theta + Q2);
+        theta[V2] *= 2.;
+        theta[W] = 1.;
+    }
+};
+
+/**
+ * Call f with a default constructed instance of the transfer function t,
+ * f is typically a generic lambda using decltype() of its argument.
+ */
+template<typename F>
+inline auto WithTransfer(Transfer_t t, F f)
+{
+    switch (t)
+    {
+    case Transfer_t::RICHARDS:
+        return f(Richards());
+    case Transfer_t::DOUBLE_LOGISTIC:
+        return f(DoubleLogistic());
+    case Transfer_t::LOGISTIC:
+    default:
+        return f(Logistic());
+    }
+}
+
+inline const char* toString(Transfer_t t)
+{
+    return WithTransfer(t, [](auto model) { return decltype(model)::name; });
+}
+
+inline bool ParseTransfer(const std::string &name, Transfer_t &t)
+{
+    for (Transfer_t i: { Transfer_t::LOGISTIC, Transfer_t::RICHARDS, Transfer_t::DOUBLE_LOGISTIC })
+    {
+        if (name == toString(i))
+        {
+            t = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+inline int TransferSize(Transfer_t t)
+{
+    return WithTransfer(t, [](auto model) { return decltype(model)::N; });
+}
+
+inline double TransferCost(Transfer_t t)
+{
+    return WithTransfer(t, [](auto model) { return decltype(model)::cost; });
+}
+
+#endif